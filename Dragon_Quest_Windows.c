@@ -1,9 +1,45 @@
 
+#ifdef __linux__
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <time.h>
 #include <windows.h>
+#include <inttypes.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <direct.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #define MAX_NAME_LENGTH 60
 #define MAX_INVENTORY 30
@@ -12,6 +48,22 @@
 #define MAX_ENEMIES 30
 #define MAX_NPCS 50
 #define MAX_SHOP_ITEMS 30
+#define MAX_NPC_LOCATIONS 8 // 一个NPC最多出现在几个地点
+#define MAX_ENCOUNTERS 16 // 每个地点最多出现的敌人种类
+
+// 字符串池，所有名称、描述和对话只保存一份，结构中只保存编号
+typedef uint32_t StringId; // 字符串在data中的偏移，0是空字符串
+#define STRING_NOT_FOUND UINT32_MAX
+
+typedef struct
+{
+    char *data;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t *table; // 开放寻址哈希表，保存编号+1，0表示空
+    uint32_t table_size;
+    uint32_t count;
+} StringPool;
 
 typedef struct
 {
@@ -29,36 +81,59 @@ typedef struct
     long intelligence; // 智力，影响魔法攻击和魔法值
 } Player;
 
+// 物品效果，use_item通过item_effects表调用
+typedef enum
+{
+    EFFECT_DEFAULT,         // 按物品类型决定，只在定义中使用
+    EFFECT_EQUIP_WEAPON,    // 装备武器
+    EFFECT_EQUIP_ARMOR,     // 装备防具
+    EFFECT_HEAL,            // 恢复value点生命值
+    EFFECT_ATTACK_UP,       // 永久增加args[0]点攻击力
+    EFFECT_AGILITY_UP,      // 永久增加args[0]点敏捷
+    EFFECT_INTELLIGENCE_UP, // 永久增加args[0]点智力和args[1]点最大魔法值
+    ITEM_EFFECTS
+} ItemEffect;
+
 typedef struct
 {
-    char name[MAX_NAME_LENGTH];
+    StringId name;
     int type;  // 0=武器, 1=防具, 2=消耗品
     int value; // 根据类型表示攻击力、防御力、恢复量的数值等
     int price;
+    int effect;  // ItemEffect
+    int args[2]; // 效果参数
 } Item;
 
 // 技能
 typedef struct
 {
-    char name[MAX_NAME_LENGTH];
+    StringId name;
     int mp_cost;
     int damage;
     int heal;
     int required_level; // 学习所需等级
 } Skill;
 
+// 技能集合，每个技能一位
+#define SKILL_WORDS ((MAX_SKILLS + 63) / 64)
+
+typedef struct
+{
+    uint64_t bits[SKILL_WORDS];
+} SkillSet;
+
 // 地点
 typedef struct
 {
-    char name[MAX_NAME_LENGTH];
-    char description[200];
+    StringId name;
+    StringId description;
     int type; // 0=城镇, 1=野外, 2=洞穴等
 } Location;
 
 // 敌人
 typedef struct
 {
-    char name[MAX_NAME_LENGTH];
+    StringId name;
     int hp;
     int max_hp;
     int attack;
@@ -71,8 +146,8 @@ typedef struct
 typedef struct
 {
     int id;
-    char name[MAX_NAME_LENGTH];
-    char description[200];
+    StringId name;
+    StringId description;
     int completed;  // 是否完成 (0=未完成, 1=完成)
     int reward_exp; // 奖励
     int reward_gold;
@@ -82,9 +157,9 @@ typedef struct
 // NPC
 typedef struct
 {
-    char name[MAX_NAME_LENGTH];
-    char dialog[200];
-    char additional_dialogs[5][200]; // 添加额外对话
+    StringId name;
+    StringId dialog;
+    StringId additional_dialogs[5]; // 添加额外对话
     int additional_dialogs_count;
     int item_to_sell; // -1表示不卖物品
     int item_price;
@@ -92,1916 +167,7147 @@ typedef struct
     int shop_item_count;
 } Npc;
 
-// 游戏数据
+// 随机数生成器 (xoshiro256**)，每个存档独立
+typedef struct
+{
+    uint64_t s[4];
+} Rng;
+
+// 输出，每局游戏独立，先收集到data中，等待输入前一次写出
+typedef struct
+{
+    FILE *file;  // 等待输入前由output_flush写入文件
+    int capture; // 没有file时保存在data中，由调用者发送；两者都没有时不输出，用于快速回放
+    char *data;
+    size_t size;
+    size_t capacity;
+} Output;
+
+// 预先拼好的菜单画面，由若干段固定文本组成，每段后面跟一个需要填入的字段
+typedef enum
+{
+    FIELD_NONE,
+    FIELD_INT,   // int，按%d输出
+    FIELD_STRING // const char *
+} FrameField;
+
+typedef struct
+{
+    const char *text;
+    size_t length;
+    int field; // FrameField
+} FrameSpan;
+
+#define FRAME_SPAN(text, field) {text, sizeof(text) - 1, field}
+#define FRAME_SPANS(frame) frame, (int)(sizeof(frame) / sizeof(frame[0]))
+
+// 遇敌表，用Walker别名法抽样：先均匀选一列，再按阈值决定取这一列的敌人还是它的别名
+typedef struct
+{
+    int count; // 0表示这里不会遇到敌人
+    int enemies[MAX_ENCOUNTERS];
+    int aliases[MAX_ENCOUNTERS];      // 别名所在的列
+    uint64_t thresholds[MAX_ENCOUNTERS]; // 取本列的概率乘以2^32
+} EncounterTable;
+
+// 世界数据，所有存档共享且只读，和字符串数据一起放在一块连续内存中，可以原样写入内容包
 typedef struct
 {
-    Player player;
-    Item inventory[MAX_INVENTORY];
     Skill skills[MAX_SKILLS];
     Location locations[MAX_LOCATIONS];
     Enemy enemies[MAX_ENEMIES];
     Npc npcs[MAX_NPCS];
     Item items[MAX_INVENTORY];
     Quest quests[10];
-    int dragon_defeated; // 恶龙是否被击败
-    int current_location;
-    int inventory_count;
-    int learned_skills[MAX_SKILLS]; // 已学习技能
-    int learned_skill_count;
-} GameData;
-
-void main_menu(GameData *game);
-
-// 函数声明
-void init_game(GameData *game);
-void init_player(Player *player);
-void init_world(GameData *game);
-void show_status(GameData *game);
-void travel(GameData *game);
-void battle(GameData *game);
-void rest(GameData *game);
-void talk_to_npc(GameData *game);
-void show_inventory(GameData *game);
-void use_item(GameData *game);
-void level_up(GameData *game);
-int calculate_damage(int attacker_attack, int defender_defense);
-void save_game(GameData *game);
-void load_game(GameData *game);
-int file_exists(const char *filename);
-void shop_menu(GameData *game, int npc_index);
-void learn_skills(GameData *game);
-int estimate_enemy_level(Enemy *enemy);
-void cheat_game(GameData *game);
+    EncounterTable encounters[MAX_LOCATIONS];
+    // 各地点的NPC按压缩行存放：地点i的NPC是location_npcs[npc_offsets[i]]到location_npcs[npc_offsets[i + 1] - 1]
+    int npc_offsets[MAX_LOCATIONS + 1];
+    int location_npcs[MAX_NPCS * MAX_NPC_LOCATIONS];
+    // 以上所有文字在字符串池中，数据和哈希表紧跟在World之后，按相对World的偏移保存
+    uint32_t text_offset;
+    uint32_t text_size;
+    uint32_t table_offset;
+    uint32_t table_size;
+    int skill_levels[MAX_SKILLS];         // 已定义技能的学习等级，从低到高
+    int skill_count;                      // 已定义的技能数
+    SkillSet skills_up_to[MAX_SKILLS + 1]; // skills_up_to[k]是学习等级最低的k个技能
+} World;
+
+// 世界数据的定义，文字直接写成字符串，由build_world放入字符串池
+typedef struct
+{
+    const char *name;
+    int type;
+    int value;
+    int price;
+    int effect; // 省略时按类型决定
+    int args[2];
+} ItemDef;
 
-// 游戏结局
-void show_ending(GameData *game)
+typedef struct
 {
-    printf("\n=====================================\n");
-    printf("                结局\n");
-    printf("=====================================\n");
-    printf("经过一番激烈的战斗，你终于击败了恶龙！\n");
-    printf("王国重新恢复了和平，人民不再生活在恐惧中。\n");
-    printf("你的名字将被永远铭记在历史中，成为传说中的英雄！\n");
-    printf("感谢您的游玩！\n");
-    printf("=====================================\n");
-}
+    const char *name;
+    int mp_cost;
+    int damage;
+    int heal;
+    int required_level;
+} SkillDef;
 
-int main()
+typedef struct
 {
-    SetConsoleOutputCP(65001);
-    GameData game;
-    srand(time(NULL));
+    const char *name;
+    const char *description;
+    int type;
+} LocationDef;
 
-    printf("=====================================\n");
-    printf("      勇者斗恶龙\n");
-    printf("=====================================\n\n");
+typedef struct
+{
+    const char *name;
+    int hp;
+    int max_hp;
+    int attack;
+    int defense;
+    int exp_reward;
+    int gold_reward;
+} EnemyDef;
 
-    printf("是否有存档要加载？(y/n): ");
-    char choice;
-    scanf(" %c", &choice);
+typedef struct
+{
+    int id;
+    const char *name;
+    const char *description;
+    int completed;
+    int reward_exp;
+    int reward_gold;
+    int reward_item;
+} QuestDef;
 
-    if (choice == 'y' || choice == 'Y')
-    {
-        if (file_exists("savegame.dat"))
-        {
-            load_game(&game);
-            printf("欢迎回来，%s！\n", game.player.name);
-        }
-        else
-        {
-            printf("未找到存档文件，开始新游戏。\n");
-            init_game(&game);
-            printf("欢迎来到勇者斗恶龙的世界，%s！\n", game.player.name);
-            printf("和平与繁荣在这片土地上已持续了数百年，\n但这份宁静被一头突然出现的恶龙打破。\n恶龙所到之处，生灵涂炭，横尸遍野\n无数勇者前去讨伐它，却化作龙巢前的累累白骨。\n而你作为一名勇敢的战士，义无反顾地踏上了解救世界的旅程。");
-        }
-    }
-    else
-    {
-        init_game(&game);
-        printf("欢迎来到勇者斗恶龙的世界，%s！\n", game.player.name);
-        printf("和平与繁荣在这片土地上已持续了数百年，\n但这份宁静被一头突然出现的恶龙打破。\n恶龙所到之处，生灵涂炭，横尸遍野\n无数勇者前去讨伐它，却化作龙巢前的累累白骨。\n而你作为一名勇敢的战士，义无反顾地踏上了解救世界的旅程。");
-    }
+typedef struct
+{
+    const char *name;
+    const char *dialog;
+    const char *additional_dialogs[5];
+    int additional_dialogs_count;
+    int item_to_sell;
+    int item_price;
+    int shop_items[MAX_SHOP_ITEMS];
+    int shop_item_count;
+    int locations[MAX_NPC_LOCATIONS]; // 出现的地点
+    int location_count;
+} NpcDef;
 
-    main_menu(&game);
+// 遇敌表中的一种敌人和它的权重，权重为0的项不使用
+typedef struct
+{
+    int enemy;
+    int weight;
+} EncounterDef;
 
-    return 0;
-}
+typedef struct
+{
+    SkillDef skills[MAX_SKILLS];
+    LocationDef locations[MAX_LOCATIONS];
+    EnemyDef enemies[MAX_ENEMIES];
+    NpcDef npcs[MAX_NPCS];
+    ItemDef items[MAX_INVENTORY];
+    QuestDef quests[10];
+    EncounterDef encounters[MAX_LOCATIONS][MAX_ENCOUNTERS];
+} WorldDef;
+
+// 战斗行动
+typedef enum
+{
+    ACTION_ATTACK = 1, // 普通攻击
+    ACTION_SKILL = 2,  // 使用技能
+    ACTION_FLEE = 3    // 逃跑
+} BattleActionType;
 
-// 初始化
-void init_game(GameData *game)
+typedef struct
 {
-    init_player(&game->player);
-    init_world(game);
-    game->current_location = 0;
-    game->inventory_count = 0;
-    game->learned_skill_count = 2; // 已学习技能
-    game->learned_skills[0] = 0;
-    game->learned_skills[1] = 1;
+    int type;
+    int skill_index; // 使用技能时的技能编号
+} BattleAction;
 
-    strcpy(game->inventory[0].name, "铁剑");
-    game->inventory[0].type = 0;
-    game->inventory[0].value = 10;
-    game->inventory_count++;
+// 战斗结果
+typedef enum
+{
+    BATTLE_ONGOING,
+    BATTLE_WON,
+    BATTLE_FLED,
+    BATTLE_LOST
+} BattleResult;
+
+// 战斗事件，由界面负责显示
+typedef enum
+{
+    EVENT_PLAYER_ATTACK,   // value=伤害
+    EVENT_PLAYER_SKILL,    // value=伤害, value2=攻击力, value3=智力加成
+    EVENT_SKILL_HEAL,      // value=恢复量
+    EVENT_NOT_ENOUGH_MP,   // MP不足，不消耗回合
+    EVENT_ENEMY_DEFEATED,  // value=经验, value2=金币
+    EVENT_DRAGON_DEFEATED, // 击败恶龙
+    EVENT_LEVEL_UP,        // value=原等级, value2=新等级
+    EVENT_ESCAPE_BLOCKED,  // 无法逃离恶龙
+    EVENT_ESCAPED,         // value=逃跑率
+    EVENT_ESCAPE_FAILED,   // value=逃跑率
+    EVENT_DODGED,          // value=闪避率
+    EVENT_ENEMY_ATTACK,    // value=伤害
+    EVENT_PLAYER_DEFEATED  // 玩家被击败
+} BattleEventType;
 
-    strcpy(game->inventory[1].name, "皮甲");
-    game->inventory[1].type = 1;
-    game->inventory[1].value = 5;
-    game->inventory_count++;
+typedef struct
+{
+    int type;
+    int skill; // 相关技能编号，-1表示无
+    int value;
+    int value2;
+    int value3;
+} BattleEvent;
 
-    strcpy(game->inventory[2].name, "生命药水");
-    game->inventory[2].type = 2;
-    game->inventory[2].value = 50;
-    game->inventory_count++;
-}
+#define MAX_BATTLE_EVENTS 8 // 每回合最多产生的事件数
 
-void init_player(Player *player)
+// 战斗状态
+typedef struct
 {
-    printf("请输入你的名字: ");
-    scanf("%s", player->name);
-
-    player->hp = 120;
-    player->max_hp = 120;
-    player->mp = 60;
-    player->max_mp = 60;
-    player->exp = 0;
-    player->level = 1;
-    player->gold = 20;
-    player->attack = 15;
-    player->defense = 5;
-    player->intelligence = 8;
-    player->agility = 5;
-}
+    Enemy enemy;
+    int enemy_type;
+    int turns;
+    int result; // BattleResult
+} BattleState;
 
-// 世界
-void init_world(GameData *game)
+// 菜单，每个值对应一个等待输入的提示
+typedef enum
+{
+    MENU_START,        // 是否有存档要加载
+    MENU_LOAD_NAME,    // 读档时输入角色名
+    MENU_LOAD_SLOT,    // 读档时选择栏位
+    MENU_NEW_NAME,     // 新游戏输入名字
+    MENU_MAIN,         // 主菜单
+    MENU_TRAVEL,       // 选择目的地
+    MENU_BATTLE,       // 选择战斗行动
+    MENU_BATTLE_SKILL, // 选择战斗技能
+    MENU_TALK,         // 选择交谈的NPC
+    MENU_INN,          // 是否在旅店休息
+    MENU_SHOP_ASK,     // 是否查看商品
+    MENU_LEARN_ASK,    // 是否学习技能
+    MENU_SHOP,         // 选择购买的物品
+    MENU_USE_ITEM,     // 选择使用的物品
+    MENU_LEARN,        // 选择学习的技能
+    MENU_SAVE,         // 选择存档栏位
+    MENU_CHEAT,        // 选择作弊
+    MENU_QUIT          // 游戏已经结束
+} MenuId;
+
+// 菜单状态，一局游戏在任何提示处都可以暂停，收到输入后由game_step继续
+typedef struct
 {
-    strcpy(game->locations[0].name, "瓦纳卡村");
-    strcpy(game->locations[0].description, "一个宁静的小村庄，承载了你儿时的记忆，是你冒险旅程的起点。");
-    game->locations[0].type = 0;
+    int id; // MenuId
+    int npc_index;
+    BattleState battle;
+    char player[MAX_NAME_LENGTH]; // 读档时输入的角色名
+} Menu;
 
-    strcpy(game->locations[1].name, "野外森林");
-    strcpy(game->locations[1].description, "野外的森林，经常有怪物出没。");
-    game->locations[1].type = 1;
+// 背包中的一种物品，同种物品叠放在一起
+#define MAX_STACK_COUNT 9999
 
-    strcpy(game->locations[2].name, "洞穴");
-    strcpy(game->locations[2].description, "阴森的洞穴。");
-    game->locations[2].type = 2;
+typedef struct
+{
+    int item;  // 世界物品编号
+    int count;
+} ItemStack;
 
-    strcpy(game->locations[3].name, "龙巢");
-    strcpy(game->locations[3].description, "恶龙的巢穴，最终决战的地方。");
-    game->locations[3].type = 3;
+// 游戏数据，只包含会变化的部分
+typedef struct
+{
+    const World *world;
+    Player player;
+    ItemStack inventory[MAX_INVENTORY]; // 每种物品最多一格，顺序无关
+    unsigned char inventory_slots[MAX_INVENTORY]; // 物品编号对应的格子+1，0表示没有
+    int dragon_defeated; // 恶龙是否被击败
+    int current_location;
+    int inventory_count; // 格子数
+    SkillSet learned_skills; // 已学习技能
+    Rng rng;
+    struct Input *input; // 玩家的输入来源，不写入存档
+    Output *output;
+    Menu menu; // 当前菜单，不写入存档
+} GameData;
 
-    strcpy(game->locations[4].name, "王城");
-    strcpy(game->locations[4].description, "王国的首都。");
-    game->locations[4].type = 4;
+// 物品效果，按ItemEffect编号放在item_effects表中
+typedef void (*ItemEffectFunc)(GameData *game, const Item *item);
+
+// 线程
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef LPTHREAD_START_ROUTINE ThreadFunc;
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE CondVar;
+#define THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN return 0
+#define MUTEX_INITIALIZER SRWLOCK_INIT
+#define COND_INITIALIZER CONDITION_VARIABLE_INIT
+#else
+typedef pthread_t Thread;
+typedef void *(*ThreadFunc)(void *);
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t CondVar;
+#define THREAD_FUNC(name) void *name(void *arg)
+#define THREAD_RETURN return NULL
+#define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define COND_INITIALIZER PTHREAD_COND_INITIALIZER
+#endif
+
+// 存档
+#define SAVE_VERSION 2 // 第2版的背包按物品叠放保存
+#define SAVE_HEADER_SIZE 16
+#define SAVE_MAX_SIZE 8192
+
+typedef enum
+{
+    SAVE_TAG_PLAYER = 1,    // 角色属性
+    SAVE_TAG_INVENTORY = 2, // 第1版的背包，每件物品一项
+    SAVE_TAG_SKILLS = 3,    // 已学习技能
+    SAVE_TAG_PROGRESS = 4,  // 当前地点、恶龙是否被击败
+    SAVE_TAG_STACKS = 5     // 背包，每种物品的名称和数量
+} SaveTag;
+
+typedef enum
+{
+    SAVE_OK,
+    SAVE_TRUNCATED,
+    SAVE_BAD_MAGIC,
+    SAVE_BAD_VERSION,
+    SAVE_BAD_CHECKSUM,
+    SAVE_CORRUPT,
+    SAVE_NOT_FOUND
+} SaveStatus;
 
-    strcpy(game->locations[5].name, "沙漠绿洲");
-    strcpy(game->locations[5].description, "沙漠中的绿洲，可以休息。");
-    game->locations[5].type = 5;
+typedef struct
+{
+    unsigned char *data;
+    size_t capacity;
+    size_t size;
+    int overflow;
+} SaveWriter;
 
-    strcpy(game->locations[6].name, "雪山");
-    strcpy(game->locations[6].description, "寒冷的雪山，据说藏着宝藏，但有雪怪出没。");
-    game->locations[6].type = 6;
+typedef struct
+{
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    int error;
+} SaveReader;
 
-    strcpy(game->locations[7].name, "地下城");
-    strcpy(game->locations[7].description, "古老的地下城，充满了危险与机遇。");
-    game->locations[7].type = 7;
+// 回放，记录一局游戏开始时的状态、随机数种子和之后的每一次输入
+#define REPLAY_VERSION 1
 
-    strcpy(game->locations[8].name, "精灵之森");
-    strcpy(game->locations[8].description, "精灵居住的森林。也潜伏着黑暗");
-    game->locations[8].type = 8;
+typedef enum
+{
+    REPLAY_INT,
+    REPLAY_CHAR,
+    REPLAY_WORD
+} ReplayValueType;
 
-    strcpy(game->locations[9].name, "海盗港湾");
-    strcpy(game->locations[9].description, "海盗聚集的港湾。");
-    game->locations[9].type = 9;
+typedef struct
+{
+    uint64_t seed;
+    unsigned char start[SAVE_MAX_SIZE]; // 开始时的存档
+    size_t start_length;
+    unsigned char *data; // 按顺序记录的输入
+    size_t size;
+    size_t capacity;
+} Replay;
 
-    strcpy(game->locations[10].name, "火山口");
-    strcpy(game->locations[10].description, "炽热的火山地带。");
-    game->locations[10].type = 10;
+// 输入，可以来自终端、文件、脚本字符串或程序回调
+#define INPUT_BUFFER_SIZE 256
 
-    strcpy(game->locations[11].name, "古代遗迹");
-    strcpy(game->locations[11].description, "失落文明的遗迹，（难度较高）");
-    game->locations[11].type = 11;
+typedef int (*InputSource)(void *context, char *buffer, int size); // 返回写入buffer的字节数，0表示输入结束，-1表示暂时没有数据
 
-    strcpy(game->locations[12].name, "黑暗沼泽");
-    strcpy(game->locations[12].description, "阴暗潮湿的沼泽地。");
-    game->locations[12].type = 12;
+typedef struct Input
+{
+    InputSource source; // 为NULL时只读取data中的内容
+    void *context;
+    const char *data;
+    int length;
+    int pos;
+    int eof;    // 来源已经读完
+    int closed; // 读取时已经没有输入
+    char buffer[INPUT_BUFFER_SIZE];
+    Replay *record;    // 不为NULL时记录读到的每个值
+    SaveReader replay; // 回放时从这里读取，data为NULL表示不在回放
+    int diverged;      // 回放内容与游戏请求的输入类型不一致
+} Input;
+
+// 后台存档
+#define SAVE_FILE "savegame.dat" // 旧版本的单一存档
+#define SAVE_PATH_LENGTH 256
+
+// 最初的版本把整个GameData原样写入savegame.dat，世界数据也在其中。
+// 按当时的布局只读出角色相关的部分，数组大小固定为当时的值
+typedef struct
+{
+    char name[60];
+    int type;
+    int value;
+    int price;
+} LegacyItem;
 
-    strcpy(game->locations[13].name, "魔法学院");
-    strcpy(game->locations[13].description, "学习高级魔法的学府。");
-    game->locations[13].type = 13;
+typedef struct
+{
+    Player player;
+    LegacyItem inventory[30];
+    char world[76 * 20 + 264 * 30 + 84 * 30 + 1396 * 50]; // 技能、地点、敌人和NPC
+    LegacyItem items[30];
+    char quests[280 * 10];
+    int dragon_defeated;
+    int current_location;
+    int inventory_count;
+    int learned_skills[20];
+    int learned_skill_count;
+} LegacyGameData;
 
-    strcpy(game->locations[14].name, "幽灵之地");
-    strcpy(game->locations[14].description, "充满了幽灵的森林。");
-    game->locations[14].type = 14;
+typedef struct SaveJob
+{
+    char path[SAVE_PATH_LENGTH];
+    unsigned char *data;
+    size_t length;
+    struct SaveJob *next;
+} SaveJob;
 
-    strcpy(game->locations[15].name, "决斗场");
-    strcpy(game->locations[15].description, "与英雄决斗的场地。（难度较高）");
-    game->locations[15].type = 15;
+typedef struct
+{
+    Mutex lock;
+    CondVar wake; // 有新的存档或需要退出
+    CondVar idle; // 所有存档都已写完
+    SaveJob *head;
+    SaveJob *tail;
+    SaveJob *writing; // 后台线程正在写入的存档，写完后才释放
+    int stop;
+    int started;
+    Thread thread;
+} SaveQueue;
+
+// 多栏位存档
+#define SAVE_DIR "saves"
+#define SAVE_INDEX_FILE "index.dat"
+#define SAVE_INDEX_VERSION 1
+#define SAVE_SLOTS 9 // 每个角色的栏位数
 
-    // 物品
-    strcpy(game->items[0].name, "铁剑");
-    game->items[0].type = 0;
-    game->items[0].value = 10;
-    game->items[0].price = 50;
-
-    strcpy(game->items[1].name, "皮甲");
-    game->items[1].type = 1;
-    game->items[1].value = 5;
-    game->items[1].price = 30;
-
-    strcpy(game->items[2].name, "生命药水");
-    game->items[2].type = 2;
-    game->items[2].value = 50;
-    game->items[2].price = 20;
-
-    strcpy(game->items[3].name, "钢剑");
-    game->items[3].type = 0;
-    game->items[3].value = 320;
-    game->items[3].price = 3200;
-
-    strcpy(game->items[4].name, "锁子甲");
-    game->items[4].type = 1;
-    game->items[4].value = 800;
-    game->items[4].price = 2000;
-
-    strcpy(game->items[5].name, "高级生命药水");
-    game->items[5].type = 2;
-    game->items[5].value = 2000;
-    game->items[5].price = 400;
-
-    strcpy(game->items[6].name, "魔法药水");
-    game->items[6].type = 2;
-    game->items[6].value = 400;
-    game->items[6].price = 800;
-
-    strcpy(game->items[7].name, "双手剑");
-    game->items[7].type = 0;
-    game->items[7].value = 4567;
-    game->items[7].price = 8000;
-
-    strcpy(game->items[8].name, "板甲");
-    game->items[8].type = 1;
-    game->items[8].value = 40;
-    game->items[8].price = 500;
-
-    strcpy(game->items[9].name, "超级生命药水");
-    game->items[9].type = 2;
-    game->items[9].value = 16000;
-    game->items[9].price = 1000;
-
-    strcpy(game->items[10].name, "传说之剑");
-    game->items[10].type = 0;
-    game->items[10].value = 8000;
-    game->items[10].price = 24000;
-
-    strcpy(game->items[11].name, "龙鳞甲");
-    game->items[11].type = 1;
-    game->items[11].value = 4000;
-    game->items[11].price = 24000;
-
-    strcpy(game->items[12].name, "短剑");
-    game->items[12].type = 0;
-    game->items[12].value = 13;
-    game->items[12].price = 100;
-
-    strcpy(game->items[13].name, "长矛");
-    game->items[13].type = 0;
-    game->items[13].value = 40;
-    game->items[13].price = 400;
-
-    strcpy(game->items[14].name, "战斧");
-    game->items[14].type = 0;
-    game->items[14].value = 80;
-    game->items[14].price = 800;
-
-    strcpy(game->items[15].name, "精灵弓");
-    game->items[15].type = 0;
-    game->items[15].value = 180;
-    game->items[15].price = 1800;
-
-    strcpy(game->items[16].name, "法杖");
-    game->items[16].type = 0;
-    game->items[16].value = 320;
-    game->items[16].price = 2800;
-
-    strcpy(game->items[17].name, "布衣");
-    game->items[17].type = 1;
-    game->items[17].value = 3;
-    game->items[17].price = 60;
-
-    strcpy(game->items[18].name, "布甲");
-    game->items[18].type = 1;
-    game->items[18].value = 12;
-    game->items[18].price = 120;
-
-    strcpy(game->items[19].name, "链甲");
-    game->items[19].type = 1;
-    game->items[19].value = 120;
-    game->items[19].price = 800;
-
-    strcpy(game->items[20].name, "骑士铠甲");
-    game->items[20].type = 1;
-    game->items[20].value = 600;
-    game->items[20].price = 2400;
-
-    strcpy(game->items[21].name, "法师之袍");
-    game->items[21].type = 1;
-    game->items[21].value = 879;
-    game->items[21].price = 3000;
-
-    strcpy(game->items[23].name, "中级生命药水");
-    game->items[23].type = 2;
-    game->items[23].value = 800;
-    game->items[23].price = 200;
-
-    strcpy(game->items[24].name, "高级魔法药水");
-    game->items[24].type = 2;
-    game->items[24].value = 1000;
-    game->items[24].price = 1800;
-
-    strcpy(game->items[26].name, "力量药剂");
-    game->items[26].type = 2;
-    game->items[26].value = 0;
-    game->items[26].price = 800;
-
-    strcpy(game->items[27].name, "敏捷药剂");
-    game->items[27].type = 2;
-    game->items[27].value = 0;
-    game->items[27].price = 800;
-
-    strcpy(game->items[28].name, "智力药剂");
-    game->items[28].type = 2;
-    game->items[28].value = 0;
-    game->items[28].price = 800;
-
-    strcpy(game->items[29].name, "狼皮");
-    game->items[29].type = 2; // 任务物品,已弃用
-    game->items[29].value = 0;
-    game->items[29].price = 10;
-
-    strcpy(game->skills[0].name, "重击");
-    game->skills[0].mp_cost = 10;
-    game->skills[0].damage = 27;
-    game->skills[0].heal = 0;
-    game->skills[0].required_level = 1;
-
-    strcpy(game->skills[1].name, "治疗");
-    game->skills[1].mp_cost = 15;
-    game->skills[1].damage = 0;
-    game->skills[1].heal = 33;
-    game->skills[1].required_level = 1;
-
-    strcpy(game->skills[2].name, "火焰术");
-    game->skills[2].mp_cost = 20;
-    game->skills[2].damage = 38;
-    game->skills[2].heal = 0;
-    game->skills[2].required_level = 3;
-
-    strcpy(game->skills[3].name, "冰霜术");
-    game->skills[3].mp_cost = 25;
-    game->skills[3].damage = 47;
-    game->skills[3].heal = 0;
-    game->skills[3].required_level = 5;
-
-    strcpy(game->skills[4].name, "惊雷");
-    game->skills[4].mp_cost = 55;
-    game->skills[4].damage = 93;
-    game->skills[4].heal = 0;
-    game->skills[4].required_level = 8;
-
-    strcpy(game->skills[5].name, "高效治疗");
-    game->skills[5].mp_cost = 60;
-    game->skills[5].damage = 0;
-    game->skills[5].heal = 300;
-    game->skills[5].required_level = 10;
-
-    strcpy(game->skills[6].name, "旋风斩");
-    game->skills[6].mp_cost = 60;
-    game->skills[6].damage = 155;
-    game->skills[6].heal = 0;
-    game->skills[6].required_level = 15;
-
-    strcpy(game->skills[7].name, "沐浴");
-    game->skills[7].mp_cost = 80;
-    game->skills[7].damage = 0;
-    game->skills[7].heal = 800;
-    game->skills[7].required_level = 25;
-
-    strcpy(game->skills[8].name, "审判");
-    game->skills[8].mp_cost = 800;
-    game->skills[8].damage = 1800;
-    game->skills[8].heal = 0;
-    game->skills[8].required_level = 50;
-
-    strcpy(game->skills[9].name, "神之祝福");
-    game->skills[9].mp_cost = 200;
-    game->skills[9].damage = 0;
-    game->skills[9].heal = 1600;
-    game->skills[9].required_level = 60;
-
-    strcpy(game->skills[10].name, "突袭");
-    game->skills[10].mp_cost = 120;
-    game->skills[10].damage = 480;
-    game->skills[10].heal = 0;
-    game->skills[10].required_level = 60;
-
-    strcpy(game->skills[11].name, "生命汲取");
-    game->skills[11].mp_cost = 80;
-    game->skills[11].damage = 300;
-    game->skills[11].heal = 300;
-    game->skills[11].required_level = 30;
-
-    strcpy(game->skills[12].name, "冻结之魔弹");
-    game->skills[12].mp_cost = 140;
-    game->skills[12].damage = 800;
-    game->skills[12].heal = 0;
-    game->skills[12].required_level = 65;
-
-    strcpy(game->skills[13].name, "雷霆之威严");
-    game->skills[13].mp_cost = 300;
-    game->skills[13].damage = 2000;
-    game->skills[13].heal = 0;
-    game->skills[13].required_level = 70;
-
-    strcpy(game->skills[14].name, "旋风斩");
-    game->skills[14].mp_cost = 300;
-    game->skills[14].damage = 600;
-    game->skills[14].heal = 0;
-    game->skills[14].required_level = 40;
-
-    strcpy(game->skills[15].name, "回溯");
-    game->skills[15].mp_cost = 1200;
-    game->skills[15].damage = 0;
-    game->skills[15].heal = 18000;
-    game->skills[15].required_level = 75;
-
-    strcpy(game->skills[16].name, "风暴");
-    game->skills[16].mp_cost = 700;
-    game->skills[16].damage = 3300;
-    game->skills[16].heal = 0;
-    game->skills[16].required_level = 80;
-
-    strcpy(game->skills[17].name, "万剑归一");
-    game->skills[17].mp_cost = 800;
-    game->skills[17].damage = 3900;
-    game->skills[17].heal = 0;
-    game->skills[17].required_level = 90;
-
-    strcpy(game->skills[18].name, "造物惩击");
-    game->skills[18].mp_cost = 1600;
-    game->skills[18].damage = 15000;
-    game->skills[18].heal = 0;
-    game->skills[18].required_level = 100;
+typedef struct
+{
+    char player[MAX_NAME_LENGTH];
+    int slot;
+    uint32_t file_id; // 存档文件名
+    int level;
+    int location;
+    int64_t saved_at;
+} SaveSlot;
 
-    // 敌人
-    strcpy(game->enemies[0].name, "哥布林");
-    game->enemies[0].hp = 30;
-    game->enemies[0].max_hp = 30;
-    game->enemies[0].attack = 10;
-    game->enemies[0].defense = 2;
-    game->enemies[0].exp_reward = 20;
-    game->enemies[0].gold_reward = 10;
-
-    strcpy(game->enemies[1].name, "狼");
-    game->enemies[1].hp = 40;
-    game->enemies[1].max_hp = 40;
-    game->enemies[1].attack = 15;
-    game->enemies[1].defense = 5;
-    game->enemies[1].exp_reward = 30;
-    game->enemies[1].gold_reward = 15;
-
-    strcpy(game->enemies[2].name, "骷髅战士");
-    game->enemies[2].hp = 800;
-    game->enemies[2].max_hp = 800;
-    game->enemies[2].attack = 250;
-    game->enemies[2].defense = 80;
-    game->enemies[2].exp_reward = 500;
-    game->enemies[2].gold_reward = 40;
-
-    strcpy(game->enemies[3].name, "恶龙");
-    game->enemies[3].hp = 120000;
-    game->enemies[3].max_hp = 120000;
-    game->enemies[3].attack = 16000;
-    game->enemies[3].defense = 1800;
-    game->enemies[3].exp_reward = 50000;
-    game->enemies[3].gold_reward = 50000;
-
-    strcpy(game->enemies[4].name, "沙漠蝎子");
-    game->enemies[4].hp = 440;
-    game->enemies[4].max_hp = 440;
-    game->enemies[4].attack = 80;
-    game->enemies[4].defense = 45;
-    game->enemies[4].exp_reward = 100;
-    game->enemies[4].gold_reward = 40;
-
-    strcpy(game->enemies[5].name, "雪怪");
-    game->enemies[5].hp = 1200;
-    game->enemies[5].max_hp = 1200;
-    game->enemies[5].attack = 90;
-    game->enemies[5].defense = 68;
-    game->enemies[5].exp_reward = 590;
-    game->enemies[5].gold_reward = 40;
-
-    strcpy(game->enemies[6].name, "海盗");
-    game->enemies[6].hp = 980;
-    game->enemies[6].max_hp = 980;
-    game->enemies[6].attack = 192;
-    game->enemies[6].defense = 29;
-    game->enemies[6].exp_reward = 620;
-    game->enemies[6].gold_reward = 80;
-
-    strcpy(game->enemies[7].name, "精灵法师");
-    game->enemies[7].hp = 2600;
-    game->enemies[7].max_hp = 2600;
-    game->enemies[7].attack = 4600;
-    game->enemies[7].defense = 15;
-    game->enemies[7].exp_reward = 1000;
-    game->enemies[7].gold_reward = 90;
-
-    strcpy(game->enemies[8].name, "石像鬼");
-    game->enemies[8].hp = 990;
-    game->enemies[8].max_hp = 990;
-    game->enemies[8].attack = 99;
-    game->enemies[8].defense = 99;
-    game->enemies[8].exp_reward = 860;
-    game->enemies[8].gold_reward = 100;
-
-    strcpy(game->enemies[9].name, "恶魔");
-    game->enemies[9].hp = 650;
-    game->enemies[9].max_hp = 650;
-    game->enemies[9].attack = 175;
-    game->enemies[9].defense = 60;
-    game->enemies[9].exp_reward = 666;
-    game->enemies[9].gold_reward = 666;
-
-    strcpy(game->enemies[10].name, "火焰巨人");
-    game->enemies[10].hp = 400;
-    game->enemies[10].max_hp = 400;
-    game->enemies[10].attack = 120;
-    game->enemies[10].defense = 30;
-    game->enemies[10].exp_reward = 460;
-    game->enemies[10].gold_reward = 180;
-
-    strcpy(game->enemies[11].name, "毒蛇");
-    game->enemies[11].hp = 20;
-    game->enemies[11].max_hp = 20;
-    game->enemies[11].attack = 30;
-    game->enemies[11].defense = 7;
-    game->enemies[11].exp_reward = 30;
-    game->enemies[11].gold_reward = 20;
-
-    strcpy(game->enemies[12].name, "幽灵");
-    game->enemies[12].hp = 600;
-    game->enemies[12].max_hp = 600;
-    game->enemies[12].attack = 50;
-    game->enemies[12].defense = 80;
-    game->enemies[12].exp_reward = 180;
-    game->enemies[12].gold_reward = 160;
-
-    strcpy(game->enemies[13].name, "石头人");
-    game->enemies[13].hp = 8000;
-    game->enemies[13].max_hp = 8000;
-    game->enemies[13].attack = 20;
-    game->enemies[13].defense = 850;
-    game->enemies[13].exp_reward = 860;
-    game->enemies[13].gold_reward = 150;
-
-    strcpy(game->enemies[14].name, "黑暗法师");
-    game->enemies[14].hp = 850;
-    game->enemies[14].max_hp = 850;
-    game->enemies[14].attack = 1280;
-    game->enemies[14].defense = 25;
-    game->enemies[14].exp_reward = 450;
-    game->enemies[14].gold_reward = 230;
-
-    strcpy(game->enemies[15].name, "地狱犬");
-    game->enemies[15].hp = 800;
-    game->enemies[15].max_hp = 800;
-    game->enemies[15].attack = 85;
-    game->enemies[15].defense = 48;
-    game->enemies[15].exp_reward = 480;
-    game->enemies[15].gold_reward = 160;
-
-    strcpy(game->enemies[16].name, "木乃伊");
-    game->enemies[16].hp = 120;
-    game->enemies[16].max_hp = 120;
-    game->enemies[16].attack = 25;
-    game->enemies[16].defense = 20;
-    game->enemies[16].exp_reward = 120;
-    game->enemies[16].gold_reward = 40;
-
-    strcpy(game->enemies[17].name, "冰霜巨龙");
-    game->enemies[17].hp = 7200;
-    game->enemies[17].max_hp = 7200;
-    game->enemies[17].attack = 620;
-    game->enemies[17].defense = 660;
-    game->enemies[17].exp_reward = 4100;
-    game->enemies[17].gold_reward = 750;
-
-    strcpy(game->enemies[18].name, "刺客");
-    game->enemies[18].hp = 440;
-    game->enemies[18].max_hp = 440;
-    game->enemies[18].attack = 200;
-    game->enemies[18].defense = 20;
-    game->enemies[18].exp_reward = 500;
-    game->enemies[18].gold_reward = 780;
-
-    strcpy(game->enemies[19].name, "熔岩元素");
-    game->enemies[19].hp = 660;
-    game->enemies[19].max_hp = 660;
-    game->enemies[19].attack = 95;
-    game->enemies[19].defense = 50;
-    game->enemies[19].exp_reward = 320;
-    game->enemies[19].gold_reward = 300;
-
-    strcpy(game->enemies[20].name, "远古巨魔");
-    game->enemies[20].hp = 1000;
-    game->enemies[20].max_hp = 1000;
-    game->enemies[20].attack = 150;
-    game->enemies[20].defense = 80;
-    game->enemies[20].exp_reward = 1000;
-    game->enemies[20].gold_reward = 900;
-
-    strcpy(game->enemies[21].name, "堕天使");
-    game->enemies[21].hp = 15000;
-    game->enemies[21].max_hp = 15000;
-    game->enemies[21].attack = 2000;
-    game->enemies[21].defense = 100;
-    game->enemies[21].exp_reward = 8500;
-    game->enemies[21].gold_reward = 1400;
-
-    strcpy(game->enemies[22].name, "混沌体");
-    game->enemies[22].hp = 38000;
-    game->enemies[22].max_hp = 38000;
-    game->enemies[22].attack = 5000;
-    game->enemies[22].defense = 300;
-    game->enemies[22].exp_reward = 8800;
-    game->enemies[22].gold_reward = 0;
-
-    strcpy(game->enemies[23].name, "虚空行者");
-    game->enemies[23].hp = 12000;
-    game->enemies[23].max_hp = 12000;
-    game->enemies[23].attack = 8800;
-    game->enemies[23].defense = 8000;
-    game->enemies[23].exp_reward = 9600;
-    game->enemies[23].gold_reward = 600;
-
-    strcpy(game->enemies[24].name, "奥赛罗");
-    game->enemies[24].hp = 67600;
-    game->enemies[24].max_hp = 67600;
-    game->enemies[24].attack = 8800;
-    game->enemies[24].defense = 6000;
-    game->enemies[24].exp_reward = 20000;
-    game->enemies[24].gold_reward = 3000;
+typedef struct
+{
+    Mutex lock;
+    SaveSlot *slots;
+    int count;
+    int capacity;
+    int *table; // 开放寻址哈希表，保存slots下标+1，0表示空
+    int table_size;
+    uint32_t next_file_id;
+    int opened;
+} SaveStore;
+
+// 内容包：文件头和ContentInfo之后是World结构，再之后是字符串数据和哈希表
+// World按本机的结构布局保存，映射到内存后直接使用，不需要解析
+#define CONTENT_VERSION 1
+#define CONTENT_OFFSET 32 // World在内容包中的位置
 
-    // NPC
-    strcpy(game->npcs[0].name, "武器商人");
-    strcpy(game->npcs[0].dialog, "欢迎光临！看看我的武器吧。");
-    game->npcs[0].item_to_sell = -1;
-    game->npcs[0].item_price = 0;
-    game->npcs[0].shop_items[0] = 0;  // 铁剑
-    game->npcs[0].shop_items[1] = 3;  // 钢剑
-    game->npcs[0].shop_items[2] = 7;  // 双手剑
-    game->npcs[0].shop_items[3] = 12; // 短剑
-    game->npcs[0].shop_items[4] = 13; // 院长矛
-    game->npcs[0].shop_items[5] = 14; // 战斧
-    game->npcs[0].shop_items[6] = 15; // 精灵弓
-    game->npcs[0].shop_items[7] = 16; // 法杖
-    game->npcs[0].shop_item_count = 8;
-
-    strcpy(game->npcs[1].name, "村长");
-    strcpy(game->npcs[1].dialog, "勇士，感谢你为我们挺身而出。你一定能击败恶龙！");
-    game->npcs[1].item_to_sell = -1;
-    game->npcs[1].item_price = 0;
-    game->npcs[1].shop_item_count = 0;
-
-    strcpy(game->npcs[2].name, "防具商人");
-    strcpy(game->npcs[2].dialog, "高质量的防具能让你在战斗中生存更久。");
-    game->npcs[2].item_to_sell = -1;
-    game->npcs[2].item_price = 0;
-    game->npcs[2].shop_items[0] = 1;  // 皮甲
-    game->npcs[2].shop_items[1] = 4;  // 锁子甲
-    game->npcs[2].shop_items[2] = 8;  // 板甲
-    game->npcs[2].shop_items[3] = 11; // 龙鳞甲
-    game->npcs[2].shop_items[4] = 17; // 布衣
-    game->npcs[2].shop_items[5] = 18; // 鳞甲
-    game->npcs[2].shop_items[6] = 19; // 链甲
-    game->npcs[2].shop_items[7] = 20; // 骑士铠甲
-    game->npcs[2].shop_items[8] = 21; // 法师袍
-    game->npcs[2].shop_item_count = 9;
-
-    strcpy(game->npcs[3].name, "药剂师");
-    strcpy(game->npcs[3].dialog, "生命药水和魔法药水，冒险必备！");
-    game->npcs[3].item_to_sell = -1;
-    game->npcs[3].item_price = 0;
-    game->npcs[3].shop_items[0] = 2;  // 生命药水
-    game->npcs[3].shop_items[1] = 5;  // 高级生命药水
-    game->npcs[3].shop_items[2] = 9;  // 超级生命药水
-    game->npcs[3].shop_items[3] = 6;  // 魔法药水
-    game->npcs[3].shop_items[4] = 23; // 中级生命药水
-    game->npcs[3].shop_items[5] = 24; // 高级魔法药水
-    game->npcs[3].shop_items[6] = 26; // 力量药剂
-    game->npcs[3].shop_items[7] = 27; // 敏捷药剂
-    game->npcs[3].shop_items[8] = 28; // 智力药剂
-    game->npcs[3].shop_item_count = 9;
-
-    strcpy(game->npcs[4].name, "技能导师");
-    strcpy(game->npcs[4].dialog, "我可以教你更强大的技能，但需要足够的等级。");
-    game->npcs[4].item_to_sell = -1;
-    game->npcs[4].item_price = 0;
-    game->npcs[4].shop_item_count = 0;
-
-    strcpy(game->npcs[5].name, "国王");
-    strcpy(game->npcs[5].dialog, "无畏的勇者，希望你能成功讨伐恶龙！");
-    game->npcs[5].item_to_sell = -1;
-    game->npcs[5].item_price = 0;
-    game->npcs[5].shop_item_count = 0;
-
-    strcpy(game->npcs[6].name, "船长");
-    strcpy(game->npcs[6].dialog, "想要出海探险吗？这片海域非常危险。");
-    game->npcs[6].item_to_sell = -1;
-    game->npcs[6].item_price = 0;
-    game->npcs[6].shop_item_count = 0;
-
-    strcpy(game->npcs[7].name, "精灵长老");
-    strcpy(game->npcs[7].dialog, "古老的魔法正在消失，我们需要你的帮助。");
-    strcpy(game->npcs[7].additional_dialogs[0], "很久以前，这片土地上充满了魔法的力量。");
-    strcpy(game->npcs[7].additional_dialogs[1], "但随着时光流逝，魔法逐渐衰弱，我们需要你的力量来恢复它。");
-    game->npcs[7].additional_dialogs_count = 2;
-    game->npcs[7].item_to_sell = -1;
-    game->npcs[7].item_price = 0;
-    game->npcs[7].shop_item_count = 0;
-
-    strcpy(game->npcs[8].name, "铁匠");
-    strcpy(game->npcs[8].dialog, "我可以用最好的材料为你打造武器和防具。");
-    strcpy(game->npcs[8].additional_dialogs[0], "我曾经为国王打造过武器，如果你有足够的金币，我可以为你打造任何武器。");
-    strcpy(game->npcs[8].additional_dialogs[1], "最近，我找到了一些稀有的矿石，可以制作出非常强大的装备。");
-    game->npcs[8].additional_dialogs_count = 2;
-    game->npcs[8].item_to_sell = -1;
-    game->npcs[8].item_price = 0;
-    game->npcs[8].shop_items[0] = 7;  // 双手剑
-    game->npcs[8].shop_items[1] = 8;  // 板甲
-    game->npcs[8].shop_items[2] = 10; // 传说之剑
-    game->npcs[8].shop_items[3] = 11; // 龙鳞甲
-    game->npcs[8].shop_items[4] = 14; // 战斧
-    game->npcs[8].shop_items[5] = 16; // 法杖
-    game->npcs[8].shop_items[6] = 20; // 骑士铠甲
-    game->npcs[8].shop_item_count = 7;
-
-    strcpy(game->npcs[9].name, "神秘商人");
-    strcpy(game->npcs[9].dialog, "我这里有一些奇特的商品，但价格不菲。");
-    strcpy(game->npcs[9].additional_dialogs[0], "这些商品是从世界各地收集来的，每一件都有独特的用途。");
-    strcpy(game->npcs[9].additional_dialogs[1], "如果你有足够的金币，我可以卖给你真正强大的物品。");
-    game->npcs[9].additional_dialogs_count = 2;
-    game->npcs[9].item_to_sell = -1;
-    game->npcs[9].item_price = 0;
-    game->npcs[9].shop_items[0] = 9;  // 超级生命药水
-    game->npcs[9].shop_items[1] = 10; // 传说之剑
-    game->npcs[9].shop_items[2] = 11; // 龙鳞甲
-    game->npcs[9].shop_items[4] = 26; // 力量药剂
-    game->npcs[9].shop_items[5] = 27; // 敏捷药剂
-    game->npcs[9].shop_items[6] = 28; // 智力药剂
-    game->npcs[9].shop_item_count = 7;
-
-    strcpy(game->npcs[10].name, "老渔夫");
-    strcpy(game->npcs[10].dialog, "这片海域隐藏着许多秘密。");
-    strcpy(game->npcs[10].additional_dialogs[0], "我在这片海上打渔几十年了，见过许多奇怪的事情。");
-    strcpy(game->npcs[10].additional_dialogs[1], "据说在深海中有一座沉没的城市，但到现在都没人能找到它。");
-    game->npcs[10].additional_dialogs_count = 2;
-    game->npcs[10].item_to_sell = -1;
-    game->npcs[10].item_price = 0;
-    game->npcs[10].shop_item_count = 0;
-
-    strcpy(game->npcs[11].name, "图书管理员");
-    strcpy(game->npcs[11].dialog, "书籍是知识的源泉。");
-    strcpy(game->npcs[11].additional_dialogs[0], "在这些古老的书籍中，记录着许多失传的法术和秘密。");
-    strcpy(game->npcs[11].additional_dialogs[1], "如果你愿意花时间学习，我可以教你一些有用的技能。");
-    game->npcs[11].additional_dialogs_count = 2;
-    game->npcs[11].item_to_sell = -1;
-    game->npcs[11].item_price = 0;
-    game->npcs[11].shop_item_count = 0;
-
-    strcpy(game->npcs[12].name, "赏金猎人");
-    strcpy(game->npcs[12].dialog, "我正在追踪一个危险的罪犯。");
-    strcpy(game->npcs[12].additional_dialogs[0], "就不必劳烦你了，我自己会找到他的。");
-    strcpy(game->npcs[12].additional_dialogs[1], "他最后一次出现在黑暗沼泽附近，小心点。");
-    game->npcs[12].additional_dialogs_count = 2;
-    game->npcs[12].item_to_sell = -1;
-    game->npcs[12].item_price = 0;
-    game->npcs[12].shop_item_count = 0;
-
-    strcpy(game->npcs[13].name, "炼金术士");
-    strcpy(game->npcs[13].dialog, "我可以将材料转化为珍贵的药水和物品。");
-    strcpy(game->npcs[13].additional_dialogs[0], "炼金术是一门深奥的学问，需要精确的配方和技巧。");
-    strcpy(game->npcs[13].additional_dialogs[1], "如果你能用等价的金钱交易，我可以为你制作强大的药水。");
-    game->npcs[13].additional_dialogs_count = 2;
-    game->npcs[13].item_to_sell = -1;
-    game->npcs[13].item_price = 0;
-    game->npcs[13].shop_items[0] = 5;  // 高级生命药水
-    game->npcs[13].shop_items[1] = 6;  // 魔法药水
-    game->npcs[13].shop_items[2] = 9;  // 超级生命药水
-    game->npcs[13].shop_items[3] = 23; // 中级生命药水
-    game->npcs[13].shop_items[4] = 24; // 高级魔法药水
-    game->npcs[13].shop_items[5] = 26; // 力量药剂
-    game->npcs[13].shop_items[6] = 27; // 敏捷药剂
-    game->npcs[13].shop_items[7] = 28; // 智力药剂
-    game->npcs[13].shop_item_count = 8;
-
-    strcpy(game->npcs[14].name, "占卜师");
-    strcpy(game->npcs[14].dialog, "我能预见未来，虽然命运往往难以改变。");
-    strcpy(game->npcs[14].additional_dialogs[0], "我看到了恶龙的爪牙正在集结，世界只有你才能拯救。");
-    strcpy(game->npcs[14].additional_dialogs[1], "小心前方的道路，危险正等着你。");
-    game->npcs[14].additional_dialogs_count = 2;
-    game->npcs[14].item_to_sell = -1;
-    game->npcs[14].item_price = 0;
-    game->npcs[14].shop_item_count = 0;
-
-    strcpy(game->npcs[16].name, "村民");
-    strcpy(game->npcs[16].dialog, "最近我听说在迷雾森林里出现了很多狼。");
-    strcpy(game->npcs[16].additional_dialogs[1], "如果你需要补给，村里的商人们会提供帮助。");
-    game->npcs[16].additional_dialogs_count = 2;
-    game->npcs[16].item_to_sell = -1;
-    game->npcs[16].item_price = 0;
-    game->npcs[16].shop_item_count = 0;
-
-    strcpy(game->npcs[17].name, "老者");
-    strcpy(game->npcs[17].dialog, "年轻人，这个世界比你想象的更加复杂。");
-    strcpy(game->npcs[17].additional_dialogs[0], "我年轻时也曾像你一样勇敢，但岁月不饶人。");
-    game->npcs[17].additional_dialogs_count = 1;
-    game->npcs[17].item_to_sell = -1;
-    game->npcs[17].item_price = 0;
-    game->npcs[17].shop_item_count = 0;
-
-    strcpy(game->npcs[19].name, "神秘女子");
-    strcpy(game->npcs[19].dialog, "我能感受到你身上的特殊气息...");
-    strcpy(game->npcs[19].additional_dialogs[0], "命运正引导着你，年轻的勇者。");
-    strcpy(game->npcs[19].additional_dialogs[1], "小心隐藏在阴影中的敌人。");
-    game->npcs[19].additional_dialogs_count = 2;
-    game->npcs[19].item_to_sell = -1;
-    game->npcs[19].item_price = 0;
-    game->npcs[19].shop_item_count = 0;
+typedef struct
+{
+    uint32_t world_size; // sizeof(World)，结构布局不同的程序不能使用
+    uint32_t byte_order; // 写入本机的0x01020304
+    uint32_t reserved[2];
+} ContentInfo;
 
-    game->dragon_defeated = 0; // 恶龙未被击败
-}
+// 内容源文件的段落，每段以[名称 编号]开头，之后是"键 = 值"
+typedef enum
+{
+    SECTION_NONE,
+    SECTION_SKILL,
+    SECTION_LOCATION,
+    SECTION_ENEMY,
+    SECTION_NPC,
+    SECTION_ITEM,
+    SECTION_QUEST,
+    CONTENT_SECTIONS
+} ContentSection;
 
-// 估算敌人等级的函数
-int estimate_enemy_level(Enemy *enemy)
+typedef struct
 {
-    // 基于敌人的属性估算等级
-    int level_by_hp = enemy->hp / 30;
-    int level_by_attack = enemy->attack / 5;
+    const char *name;
+    size_t offset; // 在WorldDef中的位置
+    size_t size;   // 每一项的大小
+    int count;
+} ContentSectionDef;
 
-    int estimated_level = (level_by_hp + level_by_attack) / 2;
+// 段落中的一个简单字段，列表和需要换算的字段另外处理
+typedef struct
+{
+    int section; // ContentSection
+    const char *key;
+    int type;      // FIELD_INT或FIELD_STRING
+    size_t offset; // 在定义结构中的位置
+} ContentField;
+
+// 服务器，一个进程同时运行多局游戏
+#ifdef __linux__
+#define SERVER_MAX_EVENTS 256
+#define WORK_DEQUE_SIZE 4096 // 每个工作线程的待处理队列长度，必须是2的幂
+
+struct Session;
+struct Server;
+
+// 会话对象的内存池，按固定大小成块申请，每个线程缓存一部分空闲对象，
+// 连接和断开不经过malloc，也不会让堆产生碎片
+#define SLAB_OBJECTS 64    // 每次向系统申请的对象数
+#define SLAB_CACHE_SIZE 64 // 每个线程最多缓存的空闲对象数
+
+typedef enum
+{
+    SLAB_SESSION,       // Session
+    SLAB_SESSION_STATE, // SessionState，休眠时归还
+    SLAB_POOLS
+} SlabPoolId;
 
-    if (estimated_level < 1)
-        estimated_level = 1;
+typedef struct SlabObject
+{
+    struct SlabObject *next;
+} SlabObject;
 
-    return estimated_level;
-}
+typedef struct
+{
+    const char *name;
+    size_t size;
+    Mutex lock; // 保护free_list，每次成批存取
+    SlabObject *free_list;
+    atomic_long allocations;
+    atomic_long frees;
+    atomic_long in_use;
+    atomic_long high_water; // 同时使用的最大对象数
+    atomic_long slabs;      // 向系统申请的块数
+} SlabPool;
+
+// 线程自己的空闲对象
+typedef struct
+{
+    SlabObject *head;
+    int count;
+} SlabCache;
 
-void main_menu(GameData *game)
+typedef struct
 {
-    int choice;
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(struct Session *) items[WORK_DEQUE_SIZE];
+} WorkDeque;
 
-    while (1)
-    {
-        printf("\n========== 主菜单 ==========\n");
-        printf("当前地点：%s\n", game->locations[game->current_location].name);
-        printf("1. 查看状态\n");
-        printf("2. 移动\n");
-        printf("3. 寻找敌人\n");
-        printf("4. 与NPC交谈\n");
-        printf("5. 查看背包\n");
-        printf("6. 使用物品\n");
-        printf("7. 休息\n");
-        printf("8. 学习技能\n");
-        printf("9. 保存游戏\n");
-        printf("0. 退出游戏\n");
-        printf("请选择: ");
+// 每个工作线程拥有一个分片：自己的epoll和待处理队列
+typedef struct
+{
+    struct Server *server;
+    int index;
+    int epoll_fd;
+    int wake_fd;      // eventfd，用于叫醒空闲的线程来窃取
+    atomic_int idle;  // 正在epoll_wait中等待
+    uint64_t steal_seed;
+    WorkDeque queue;
+    Thread thread;
+    Mutex lock; // 保护活动链表
+    struct Session *active_head;
+    struct Session *active_tail;
+    time_t next_scan; // 下次检查空闲会话的时间
+} Worker;
+
+typedef struct Server
+{
+    int listen_fd;
+    Worker *workers;
+    int worker_count;
+    int session_count; // 只由接受连接的线程修改
+    int hibernate_after; // 空闲多少秒后休眠，0表示不休眠
+    uint64_t seed;
+} Server;
+
+// 服务器使用的一个内容包版本。重新载入时发布新版本，旧版本在最后一个会话换走后释放
+typedef struct
+{
+    const unsigned char *content; // 重新载入的内容包，启动时的世界为NULL，不释放
+    size_t length;
+    const World *world;
+    unsigned generation; // 第几个发布的版本，启动时的为1
+    int users; // 使用它的会话数，最新版本另外多算一次，由content_lock保护
+} ContentVersion;
+
+// 会话的完整状态，休眠时释放
+typedef struct
+{
+    GameData game;
+    Input input;
+    Output output;
+} SessionState;
 
-        scanf("%d", &choice);
+// 每个连接一局游戏，等待输入时只保存菜单状态，不占用线程和栈
+typedef struct Session
+{
+    Worker *owner; // 所属分片，会话可能被其他线程窃取执行，但始终登记在这个分片的epoll中
+    struct Session *prev; // 分片的活动链表，按最后一次输入的时间排序
+    struct Session *next;
+    int listed;
+    int fd;
+    atomic_int busy;     // 正在被处理或休眠
+    SessionState *state; // 休眠时为NULL
+    unsigned char *image; // 休眠时的紧凑记录
+    size_t image_size;
+    time_t active; // 最后一次处理输入的时间
+    size_t sent;   // output中已经发送的字节数
+    int broken;    // 连接出错
+    ContentVersion *content; // 这局游戏使用的世界，休眠时也保留
+    unsigned failed_generation; // 换用这个版本失败，发布新版本之前不再尝试
+} Session;
+#endif
+
+// 平衡性模拟
+#define SIM_HP_BUCKETS 10  // HP损失分布的分组数，每组10%
+#define SIM_MAX_TURNS 1000 // 超过该回合数视为僵持
+
+typedef enum
+{
+    STRATEGY_ATTACK,  // 只用普通攻击
+    STRATEGY_SKILL,   // 优先使用伤害最高的技能
+    STRATEGY_CAUTIOUS // 同上，生命值低于30%时逃跑
+} SimStrategy;
 
-        switch (choice)
-        {
-        case 1:
-            show_status(game);
-            break;
-        case 2:
-            travel(game);
-            break;
-        case 3:
-            battle(game);
-            break;
-        case 4:
-            talk_to_npc(game);
-            break;
-        case 5:
-            show_inventory(game);
-            break;
-        case 6:
-            use_item(game);
-            break;
-        case 7:
-            rest(game);
-            break;
-        case 8:
-            learn_skills(game);
-            break;
-        case 9:
-            save_game(game);
-            break;
-        case 0:
-            printf("感谢游玩！再见！\n");
-            exit(0);
-        case 666:
-            cheat_game(game);
-            break;
-        case 114514:
-            printf("哼哼哼啊啊啊啊啊啊啊啊啊啊！！！！！！\n");
-        default:
-            printf("无效选择，请重新输入。\n");
-        }
-    }
-}
+typedef struct
+{
+    long wins;
+    long fled;
+    long losses;
+    long timeouts;
+    long total_turns;
+    long hp_loss[SIM_HP_BUCKETS + 1]; // 最后一组表示阵亡
+} SimStats;
 
-// 状态
-void show_status(GameData *game)
+typedef struct
 {
-    printf("\n========== 角色状态 ==========\n");
-    printf("姓名: %s\n", game->player.name);
-    printf("等级: %d\n", game->player.level);
-    printf("经验值: %d/%d\n", game->player.exp, game->player.level * 100);
-    printf("生命值: %d/%d\n", game->player.hp, game->player.max_hp);
-    printf("魔法值: %d/%d\n", game->player.mp, game->player.max_mp);
-    printf("攻击力: %d\n", game->player.attack);
-    printf("防御力: %d\n", game->player.defense);
-    printf("敏捷: %d\n", game->player.agility);
-    printf("智力: %d\n", game->player.intelligence);
-    printf("金币: %d\n", game->player.gold);
-    printf("=============================\n");
-}
+    int level;
+    int location;
+} SimCell;
 
-void travel(GameData *game)
+typedef struct
 {
-    int i, choice;
+    const GameData *base; // 已初始化世界数据的模板
+    SimCell *cells;
+    int cell_count;
+    int strategy;
+} SimJob;
 
-    printf("\n========== 可去地点 ==========\n");
-    for (i = 0; i < 14; i++)
-    {
-        if (i != game->current_location)
-        {
-            printf("%d. %s - %s\n", i + 1, game->locations[i].name, game->locations[i].description);
-        }
-    }
-    printf("请选择目的地 (输入对应数字): ");
+typedef struct
+{
+    SimJob *job;
+    uint64_t seed;
+    long trials; // 每组由该线程模拟的场数
+    SimStats *stats;
+    Thread thread;
+} SimWorker;
 
-    scanf("%d", &choice);
-    choice--;
+void main_menu(GameData *game);
+void main_menu_input(GameData *game, int choice);
 
-    if (choice >= 0 && choice < 14 && choice != game->current_location)
-    {
-        game->current_location = choice;
-        printf("你来到了%s。\n", game->locations[game->current_location].name);
-    }
+// 函数声明
+void start_game(GameData *game);
+void start_game_input(GameData *game, char choice);
+int game_step(GameData *game);
+void run_game(GameData *game);
+void init_game(GameData *game);
+void init_player(GameData *game);
+void init_player_name(GameData *game, const char *name);
+void show_status(GameData *game);
+void travel(GameData *game);
+void travel_input(GameData *game, int choice);
+void battle(GameData *game);
+void battle_menu(GameData *game);
+int battle_skills(GameData *game, int *skills);
+void battle_input(GameData *game, int choice);
+void battle_skill_input(GameData *game, int choice);
+void battle_action(GameData *game, const BattleAction *action);
+void rest(GameData *game);
+void talk_to_npc(GameData *game);
+void talk_to_npc_input(GameData *game, int choice);
+void inn_input(GameData *game, char choice);
+void show_inventory(GameData *game);
+void use_item(GameData *game);
+void use_item_input(GameData *game, int choice);
+void level_up(GameData *game);
+int gain_level(Player *player);
+void show_level_up(GameData *game, int level);
+int calculate_damage(Rng *rng, int attacker_attack, int defender_defense);
+void rng_seed(Rng *rng, uint64_t seed);
+uint64_t rng_rotl(uint64_t x, int k);
+uint64_t rng_next(Rng *rng);
+int rng_below(Rng *rng, int bound);
+void rng_fill(Rng *rng, uint64_t *out, size_t count);
+int file_source(void *context, char *buffer, int size);
+void input_init(Input *input, InputSource source, void *context);
+void input_from_file(Input *input, FILE *file);
+void input_from_string(Input *input, const char *script);
+int input_closed(const Input *input);
+int input_fill(Input *input);
+int input_peek(Input *input);
+int input_ready(Input *input);
+int input_skip_space(Input *input);
+int read_int(Input *input);
+char read_char(Input *input);
+void read_word(Input *input, char *buffer, size_t size);
+void print(GameData *game, const char *format, ...);
+void output_append(Output *output, const char *format, va_list args);
+int output_reserve(Output *output, size_t length);
+void output_write(Output *output, const char *data, size_t length);
+void print_frame(GameData *game, const FrameSpan *spans, int count, ...);
+void output_flush(Output *output);
+void replay_begin(Replay *replay, uint64_t seed, const GameData *game);
+void replay_free(Replay *replay);
+void replay_put(Replay *replay, int type, uint64_t value, const char *text);
+unsigned char *replay_encode(const Replay *replay, size_t *length);
+int write_replay(const Replay *replay, const char *path);
+void input_from_replay(Input *input, const unsigned char *data, size_t length);
+int input_replaying(const Input *input);
+int replay_next(Input *input, int type, uint64_t *value);
+int play_replay(const char *path);
+int run_replays(int argc, char *argv[]);
+#ifdef __linux__
+int set_nonblocking(int fd);
+int open_listener(const char *address);
+int session_source(void *context, char *buffer, int size);
+int work_push(WorkDeque *deque, Session *session);
+Session *work_pop(WorkDeque *deque);
+Session *work_steal(WorkDeque *deque);
+int session_finished(Session *session);
+void session_flush(Session *session);
+int watch_session(Session *session, int operation);
+void run_session(Session *session);
+void close_session(Session *session);
+void open_session(Server *server, int fd);
+void accept_sessions(Server *server);
+Session *steal_session(Worker *worker);
+void wake_idle_worker(Worker *worker);
+void claim_session(Session *session);
+void release_session(Session *session);
+void unlink_session(Session *session);
+void touch_session(Session *session);
+int hibernate_session(Session *session);
+int wake_session(Session *session);
+void hibernate_idle_sessions(Worker *worker, time_t now);
+void *slab_alloc(int pool);
+void slab_free(int pool, void *object);
+void slab_report(FILE *file);
+void request_slab_report(int signal_number);
+#endif
+int run_server(int argc, char *argv[]);
+void save_game(GameData *game);
+void save_game_input(GameData *game, int slot);
+void load_game(GameData *game);
+void load_game_name(GameData *game, const char *player);
+void load_game_slot(GameData *game, int slot);
+void load_game_failed(GameData *game);
+void shop_menu(GameData *game, int npc_index);
+void shop_menu_input(GameData *game, int choice);
+int learnable_skills(GameData *game, int *skills);
+void learn_skills(GameData *game);
+void learn_skills_input(GameData *game, int choice);
+int estimate_enemy_level(Enemy *enemy);
+void cheat_game(GameData *game);
+void cheat_game_input(GameData *game, int cheat_choice);
+int choose_enemy(GameData *game);
+void battle_begin(GameData *game, BattleState *state, int enemy_type);
+int battle_step(GameData *game, BattleState *state, const BattleAction *action, BattleEvent *events);
+int skill_available(GameData *game, int skill_index);
+int skill_set_has(const SkillSet *set, int skill);
+void skill_set_add(SkillSet *set, int skill);
+int skill_set_list(const SkillSet *set, int *skills);
+SkillSet skills_for_level(const World *world, long level);
+void show_battle_events(GameData *game, BattleState *state, BattleEvent *events, int count);
+void init_player_stats(Player *player);
+int cpu_count(void);
+int thread_start(Thread *thread, ThreadFunc func, void *arg);
+void thread_join(Thread thread);
+void mutex_init(Mutex *mutex);
+void mutex_lock(Mutex *mutex);
+void mutex_unlock(Mutex *mutex);
+void cond_init(CondVar *cond);
+void cond_wait(CondVar *cond, Mutex *mutex);
+void cond_signal(CondVar *cond);
+void cond_broadcast(CondVar *cond);
+void choose_sim_action(GameData *game, BattleState *state, int strategy, BattleAction *action);
+void setup_sim_player(GameData *game, int level);
+void simulate_battle(GameData *game, const Player *start, int strategy, SimStats *stats);
+int display_width(const char *text);
+void print_sim_stats(GameData *game, SimCell *cell, SimStats *stats);
+int run_simulation(int argc, char *argv[]);
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+void put_u8(SaveWriter *writer, unsigned value);
+void put_u16(SaveWriter *writer, unsigned value);
+void put_u32(SaveWriter *writer, uint32_t value);
+void put_varint(SaveWriter *writer, uint64_t value);
+void put_svarint(SaveWriter *writer, int64_t value);
+void put_bytes(SaveWriter *writer, const void *data, size_t length);
+void put_string(SaveWriter *writer, const char *text);
+size_t begin_record(SaveWriter *writer, int tag);
+void end_record(SaveWriter *writer, size_t start);
+unsigned get_u8(SaveReader *reader);
+unsigned get_u16(SaveReader *reader);
+uint32_t get_u32(SaveReader *reader);
+uint64_t get_varint(SaveReader *reader);
+int64_t get_svarint(SaveReader *reader);
+void get_string(SaveReader *reader, char *text, size_t size);
+size_t save_encode(const GameData *game, unsigned char *buffer, size_t capacity);
+size_t finish_header(SaveWriter *writer, const char *magic, unsigned version);
+int check_header(const unsigned char *buffer, size_t length, const char *magic, unsigned max_version);
+int save_validate(const unsigned char *buffer, size_t length);
+const char *save_status_text(int status);
+int save_decode(GameData *game, const unsigned char *buffer, size_t length);
+long read_file(const char *filename, unsigned char *buffer, size_t capacity);
+unsigned char *load_file(const char *filename, size_t *length);
+int verify_save_file(const char *path, unsigned char *buffer, size_t capacity);
+int verify_saves(int argc, char *argv[]);
+int write_file_atomic(const char *path, const unsigned char *data, size_t length);
+int save_queue_push(const char *path, const unsigned char *data, size_t length);
+long save_queue_read(const char *path, unsigned char *buffer, size_t capacity);
+void save_queue_flush(void);
+void save_queue_shutdown(void);
+uint32_t slot_hash(const char *player, int slot);
+int slot_probe(SaveStore *store, const char *player, int slot);
+void rebuild_slot_table(SaveStore *store, int table_size);
+SaveSlot *add_slot(SaveStore *store, const char *player, int slot);
+void slot_path(const SaveSlot *entry, const char *extension, char *path, size_t size);
+unsigned char *encode_slot_index(SaveStore *store, size_t *length);
+int decode_slot_index(SaveStore *store, const unsigned char *buffer, size_t length);
+void report_store_error(GameData *game, const char *message);
+void write_slot_index(SaveStore *store, GameData *game);
+int convert_legacy_save(GameData *game, const unsigned char *data, size_t length);
+void import_legacy_save(SaveStore *store, GameData *game);
+void open_save_store(SaveStore *store, GameData *game);
+int find_save_slot(GameData *game, const char *player, int slot, SaveSlot *entry);
+int save_to_slot(GameData *game, int slot);
+int load_from_slot(GameData *game, const char *player, int slot);
+int verify_save_store(unsigned char *buffer, size_t capacity, int *total);
+int show_save_slots(GameData *game, const char *player, int show_empty);
+StringId string_intern(StringPool *pool, const char *text);
+StringId string_find(const World *world, const char *text);
+const char *text(const World *world, StringId id);
+void build_world(World *world, StringPool *strings, const WorldDef *def);
+unsigned char *build_content(const WorldDef *def, size_t *length);
+const World *content_world(const unsigned char *content);
+const unsigned char *load_content(const char *path, size_t *length);
+int parse_content(char *source, const char *path, WorldDef *def);
+void write_content_source(FILE *file, const WorldDef *def);
+int compile_content(int argc, char *argv[]);
+int export_content(int argc, char *argv[]);
+void build_encounter_table(EncounterTable *table, const EncounterDef *def);
+int draw_encounter(const EncounterTable *table, Rng *rng);
+void build_location_npcs(World *world, const WorldDef *def);
+const int *location_npcs(const World *world, int location, int *count);
+int default_item_effect(int type);
+int find_item(const World *world, StringId name);
+int add_item(GameData *game, int item, int count);
+void remove_item(GameData *game, int slot);
+void equip_weapon(GameData *game, const Item *item);
+void equip_armor(GameData *game, const Item *item);
+void heal_item(GameData *game, const Item *item);
+void attack_up_item(GameData *game, const Item *item);
+void agility_up_item(GameData *game, const Item *item);
+void intelligence_up_item(GameData *game, const Item *item);
+
+// 使用中的世界，启动时由内置定义建立或者映射内容包，之后整个进程共享一份只读数据
+static const World *current_world;
+static const char *content_path; // --content指定的内容包，服务器收到SIGHUP时重新载入
+
+// 内置世界的定义，没有指定内容包时由build_content转换
+static const WorldDef builtin_world_def =
+{
+    // 地点
+    .locations =
+    {
+        {"瓦纳卡村", "一个宁静的小村庄，承载了你儿时的记忆，是你冒险旅程的起点。", 0},
+        {"野外森林", "野外的森林，经常有怪物出没。", 1},
+        {"洞穴", "阴森的洞穴。", 2},
+        {"龙巢", "恶龙的巢穴，最终决战的地方。", 3},
+        {"王城", "王国的首都。", 4},
+        {"沙漠绿洲", "沙漠中的绿洲，可以休息。", 5},
+        {"雪山", "寒冷的雪山，据说藏着宝藏，但有雪怪出没。", 6},
+        {"地下城", "古老的地下城，充满了危险与机遇。", 7},
+        {"精灵之森", "精灵居住的森林。也潜伏着黑暗", 8},
+        {"海盗港湾", "海盗聚集的港湾。", 9},
+        {"火山口", "炽热的火山地带。", 10},
+        {"古代遗迹", "失落文明的遗迹，（难度较高）", 11},
+        {"黑暗沼泽", "阴暗潮湿的沼泽地。", 12},
+        {"魔法学院", "学习高级魔法的学府。", 13},
+        {"幽灵之地", "充满了幽灵的森林。", 14},
+        {"决斗场", "与英雄决斗的场地。（难度较高）", 15},
+    },
+    // 物品
+    .items =
+    {
+        [0] = {"铁剑", 0, 10, 50},
+        [1] = {"皮甲", 1, 5, 30},
+        [2] = {"生命药水", 2, 50, 20},
+        [3] = {"钢剑", 0, 320, 3200},
+        [4] = {"锁子甲", 1, 800, 2000},
+        [5] = {"高级生命药水", 2, 2000, 400},
+        [6] = {"魔法药水", 2, 400, 800},
+        [7] = {"双手剑", 0, 4567, 8000},
+        [8] = {"板甲", 1, 40, 500},
+        [9] = {"超级生命药水", 2, 16000, 1000},
+        [10] = {"传说之剑", 0, 8000, 24000},
+        [11] = {"龙鳞甲", 1, 4000, 24000},
+        [12] = {"短剑", 0, 13, 100},
+        [13] = {"长矛", 0, 40, 400},
+        [14] = {"战斧", 0, 80, 800},
+        [15] = {"精灵弓", 0, 180, 1800},
+        [16] = {"法杖", 0, 320, 2800},
+        [17] = {"布衣", 1, 3, 60},
+        [18] = {"布甲", 1, 12, 120},
+        [19] = {"链甲", 1, 120, 800},
+        [20] = {"骑士铠甲", 1, 600, 2400},
+        [21] = {"法师之袍", 1, 879, 3000},
+        [23] = {"中级生命药水", 2, 800, 200},
+        [24] = {"高级魔法药水", 2, 1000, 1800},
+        [26] = {"力量药剂", 2, 0, 800, EFFECT_ATTACK_UP, {5}},
+        [27] = {"敏捷药剂", 2, 0, 800, EFFECT_AGILITY_UP, {5}},
+        [28] = {"智力药剂", 2, 0, 800, EFFECT_INTELLIGENCE_UP, {5, 20}},
+        [29] = {"狼皮", 2, 0, 10}, // 任务物品,已弃用
+    },
+    // 技能
+    .skills =
+    {
+        {"重击", 10, 27, 0, 1},
+        {"治疗", 15, 0, 33, 1},
+        {"火焰术", 20, 38, 0, 3},
+        {"冰霜术", 25, 47, 0, 5},
+        {"惊雷", 55, 93, 0, 8},
+        {"高效治疗", 60, 0, 300, 10},
+        {"旋风斩", 60, 155, 0, 15},
+        {"沐浴", 80, 0, 800, 25},
+        {"审判", 800, 1800, 0, 50},
+        {"神之祝福", 200, 0, 1600, 60},
+        {"突袭", 120, 480, 0, 60},
+        {"生命汲取", 80, 300, 300, 30},
+        {"冻结之魔弹", 140, 800, 0, 65},
+        {"雷霆之威严", 300, 2000, 0, 70},
+        {"旋风斩", 300, 600, 0, 40},
+        {"回溯", 1200, 0, 18000, 75},
+        {"风暴", 700, 3300, 0, 80},
+        {"万剑归一", 800, 3900, 0, 90},
+        {"造物惩击", 1600, 15000, 0, 100},
+    },
+    // 敌人
+    .enemies =
+    {
+        {"哥布林", 30, 30, 10, 2, 20, 10},
+        {"狼", 40, 40, 15, 5, 30, 15},
+        {"骷髅战士", 800, 800, 250, 80, 500, 40},
+        {"恶龙", 120000, 120000, 16000, 1800, 50000, 50000},
+        {"沙漠蝎子", 440, 440, 80, 45, 100, 40},
+        {"雪怪", 1200, 1200, 90, 68, 590, 40},
+        {"海盗", 980, 980, 192, 29, 620, 80},
+        {"精灵法师", 2600, 2600, 4600, 15, 1000, 90},
+        {"石像鬼", 990, 990, 99, 99, 860, 100},
+        {"恶魔", 650, 650, 175, 60, 666, 666},
+        {"火焰巨人", 400, 400, 120, 30, 460, 180},
+        {"毒蛇", 20, 20, 30, 7, 30, 20},
+        {"幽灵", 600, 600, 50, 80, 180, 160},
+        {"石头人", 8000, 8000, 20, 850, 860, 150},
+        {"黑暗法师", 850, 850, 1280, 25, 450, 230},
+        {"地狱犬", 800, 800, 85, 48, 480, 160},
+        {"木乃伊", 120, 120, 25, 20, 120, 40},
+        {"冰霜巨龙", 7200, 7200, 620, 660, 4100, 750},
+        {"刺客", 440, 440, 200, 20, 500, 780},
+        {"熔岩元素", 660, 660, 95, 50, 320, 300},
+        {"远古巨魔", 1000, 1000, 150, 80, 1000, 900},
+        {"堕天使", 15000, 15000, 2000, 100, 8500, 1400},
+        {"混沌体", 38000, 38000, 5000, 300, 8800, 0},
+        {"虚空行者", 12000, 12000, 8800, 8000, 9600, 600},
+        {"奥赛罗", 67600, 67600, 8800, 6000, 20000, 3000},
+    },
+    // 各地点遇到的敌人和权重，没有列出的地点是安全区域
+    .encounters =
+    {
+        [1] = {{0, 1}, {1, 1}, {11, 1}},   // 野外森林 - 哥布林、狼或毒蛇
+        [2] = {{16, 1}, {2, 1}},           // 洞穴 - 木乃伊或骷髅战士
+        [3] = {{3, 1}},                    // 龙巢 - 恶龙
+        [5] = {{4, 1}},                    // 沙漠绿洲 - 沙漠蝎子
+        [6] = {{17, 1}, {5, 1}},           // 雪山 - 冰霜巨龙或雪怪
+        [7] = {{8, 1}, {9, 1}},            // 地下城 - 石像鬼或恶魔
+        [8] = {{16, 1}, {7, 1}},           // 精灵之森 - 木乃伊或精灵法师
+        [9] = {{6, 1}},                    // 海盗港湾 - 海盗
+        [10] = {{19, 1}, {10, 1}},         // 火山口 - 熔岩元素或火焰巨人
+        [11] = {{21, 1}, {22, 1}, {23, 1}}, // 古代遗迹 - 堕天使、混沌体或虚空行者
+        [12] = {{12, 1}, {11, 1}},         // 黑暗沼泽 - 幽灵或毒蛇
+        [14] = {{18, 1}, {12, 1}},         // 幽灵之地 - 刺客或幽灵
+        [15] = {{24, 1}},                  // 决斗场 - 奥赛罗
+    },
+    // NPC
+    .npcs =
+    {
+        [0] =
+        {
+            .name = "武器商人",
+            .locations = {0, 9}, // 瓦纳卡村、海盗港湾
+            .location_count = 2,
+            .dialog = "欢迎光临！看看我的武器吧。",
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_items =
+            {
+                [0] = 0,  // 铁剑
+                [1] = 3,  // 钢剑
+                [2] = 7,  // 双手剑
+                [3] = 12, // 短剑
+                [4] = 13, // 院长矛
+                [5] = 14, // 战斧
+                [6] = 15, // 精灵弓
+                [7] = 16, // 法杖
+            },
+            .shop_item_count = 8,
+        },
+        [1] =
+        {
+            .name = "村长",
+            .locations = {0}, // 瓦纳卡村
+            .location_count = 1,
+            .dialog = "勇士，感谢你为我们挺身而出。你一定能击败恶龙！",
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [2] =
+        {
+            .name = "防具商人",
+            .locations = {0, 4}, // 瓦纳卡村、王城
+            .location_count = 2,
+            .dialog = "高质量的防具能让你在战斗中生存更久。",
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_items =
+            {
+                [0] = 1,  // 皮甲
+                [1] = 4,  // 锁子甲
+                [2] = 8,  // 板甲
+                [3] = 11, // 龙鳞甲
+                [4] = 17, // 布衣
+                [5] = 18, // 鳞甲
+                [6] = 19, // 链甲
+                [7] = 20, // 骑士铠甲
+                [8] = 21, // 法师袍
+            },
+            .shop_item_count = 9,
+        },
+        [3] =
+        {
+            .name = "药剂师",
+            .locations = {0, 4}, // 瓦纳卡村、王城
+            .location_count = 2,
+            .dialog = "生命药水和魔法药水，冒险必备！",
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_items =
+            {
+                [0] = 2,  // 生命药水
+                [1] = 5,  // 高级生命药水
+                [2] = 9,  // 超级生命药水
+                [3] = 6,  // 魔法药水
+                [4] = 23, // 中级生命药水
+                [5] = 24, // 高级魔法药水
+                [6] = 26, // 力量药剂
+                [7] = 27, // 敏捷药剂
+                [8] = 28, // 智力药剂
+            },
+            .shop_item_count = 9,
+        },
+        [4] =
+        {
+            .name = "技能导师",
+            .locations = {4, 8, 13}, // 王城、精灵之森、魔法学院
+            .location_count = 3,
+            .dialog = "我可以教你更强大的技能，但需要足够的等级。",
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [5] =
+        {
+            .name = "国王",
+            .locations = {4}, // 王城
+            .location_count = 1,
+            .dialog = "无畏的勇者，希望你能成功讨伐恶龙！",
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [6] =
+        {
+            .name = "船长",
+            .locations = {9}, // 海盗港湾
+            .location_count = 1,
+            .dialog = "想要出海探险吗？这片海域非常危险。",
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [7] =
+        {
+            .name = "精灵长老",
+            .locations = {8}, // 精灵之森
+            .location_count = 1,
+            .dialog = "古老的魔法正在消失，我们需要你的帮助。",
+            .additional_dialogs =
+            {
+                "很久以前，这片土地上充满了魔法的力量。",
+                "但随着时光流逝，魔法逐渐衰弱，我们需要你的力量来恢复它。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [8] =
+        {
+            .name = "铁匠",
+            .locations = {4}, // 王城
+            .location_count = 1,
+            .dialog = "我可以用最好的材料为你打造武器和防具。",
+            .additional_dialogs =
+            {
+                "我曾经为国王打造过武器，如果你有足够的金币，我可以为你打造任何武器。",
+                "最近，我找到了一些稀有的矿石，可以制作出非常强大的装备。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_items =
+            {
+                [0] = 7,  // 双手剑
+                [1] = 8,  // 板甲
+                [2] = 10, // 传说之剑
+                [3] = 11, // 龙鳞甲
+                [4] = 14, // 战斧
+                [5] = 16, // 法杖
+                [6] = 20, // 骑士铠甲
+            },
+            .shop_item_count = 7,
+        },
+        [9] =
+        {
+            .name = "神秘商人",
+            .dialog = "我这里有一些奇特的商品，但价格不菲。",
+            .additional_dialogs =
+            {
+                "这些商品是从世界各地收集来的，每一件都有独特的用途。",
+                "如果你有足够的金币，我可以卖给你真正强大的物品。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_items =
+            {
+                [0] = 9,  // 超级生命药水
+                [1] = 10, // 传说之剑
+                [2] = 11, // 龙鳞甲
+                [4] = 26, // 力量药剂
+                [5] = 27, // 敏捷药剂
+                [6] = 28, // 智力药剂
+            },
+            .shop_item_count = 7,
+        },
+        [10] =
+        {
+            .name = "老渔夫",
+            .locations = {9}, // 海盗港湾
+            .location_count = 1,
+            .dialog = "这片海域隐藏着许多秘密。",
+            .additional_dialogs =
+            {
+                "我在这片海上打渔几十年了，见过许多奇怪的事情。",
+                "据说在深海中有一座沉没的城市，但到现在都没人能找到它。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [11] =
+        {
+            .name = "图书管理员",
+            .locations = {4, 13}, // 王城、魔法学院
+            .location_count = 2,
+            .dialog = "书籍是知识的源泉。",
+            .additional_dialogs =
+            {
+                "在这些古老的书籍中，记录着许多失传的法术和秘密。",
+                "如果你愿意花时间学习，我可以教你一些有用的技能。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [12] =
+        {
+            .name = "赏金猎人",
+            .locations = {10, 12}, // 火山口、黑暗沼泽
+            .location_count = 2,
+            .dialog = "我正在追踪一个危险的罪犯。",
+            .additional_dialogs =
+            {
+                "就不必劳烦你了，我自己会找到他的。",
+                "他最后一次出现在黑暗沼泽附近，小心点。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [13] =
+        {
+            .name = "炼金术士",
+            .locations = {13}, // 魔法学院
+            .location_count = 1,
+            .dialog = "我可以将材料转化为珍贵的药水和物品。",
+            .additional_dialogs =
+            {
+                "炼金术是一门深奥的学问，需要精确的配方和技巧。",
+                "如果你能用等价的金钱交易，我可以为你制作强大的药水。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_items =
+            {
+                [0] = 5,  // 高级生命药水
+                [1] = 6,  // 魔法药水
+                [2] = 9,  // 超级生命药水
+                [3] = 23, // 中级生命药水
+                [4] = 24, // 高级魔法药水
+                [5] = 26, // 力量药剂
+                [6] = 27, // 敏捷药剂
+                [7] = 28, // 智力药剂
+            },
+            .shop_item_count = 8,
+        },
+        [14] =
+        {
+            .name = "占卜师",
+            .locations = {13}, // 魔法学院
+            .location_count = 1,
+            .dialog = "我能预见未来，虽然命运往往难以改变。",
+            .additional_dialogs =
+            {
+                "我看到了恶龙的爪牙正在集结，世界只有你才能拯救。",
+                "小心前方的道路，危险正等着你。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [16] =
+        {
+            .name = "村民",
+            .locations = {0}, // 瓦纳卡村
+            .location_count = 1,
+            .dialog = "最近我听说在迷雾森林里出现了很多狼。",
+            .additional_dialogs =
+            {
+                [1] = "如果你需要补给，村里的商人们会提供帮助。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [17] =
+        {
+            .name = "老者",
+            .locations = {0}, // 瓦纳卡村
+            .location_count = 1,
+            .dialog = "年轻人，这个世界比你想象的更加复杂。",
+            .additional_dialogs =
+            {
+                "我年轻时也曾像你一样勇敢，但岁月不饶人。",
+            },
+            .additional_dialogs_count = 1,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+        [19] =
+        {
+            .name = "神秘女子",
+            .locations = {0}, // 瓦纳卡村
+            .location_count = 1,
+            .dialog = "我能感受到你身上的特殊气息...",
+            .additional_dialogs =
+            {
+                "命运正引导着你，年轻的勇者。",
+                "小心隐藏在阴影中的敌人。",
+            },
+            .additional_dialogs_count = 2,
+            .item_to_sell = -1,
+            .item_price = 0,
+            .shop_item_count = 0,
+        },
+    },
+};
+
+
+// 游戏结局
+void show_ending(GameData *game)
+{
+    print(game, "\n=====================================\n");
+    print(game, "                结局\n");
+    print(game, "=====================================\n");
+    print(game, "经过一番激烈的战斗，你终于击败了恶龙！\n");
+    print(game, "王国重新恢复了和平，人民不再生活在恐惧中。\n");
+    print(game, "你的名字将被永远铭记在历史中，成为传说中的英雄！\n");
+    print(game, "感谢您的游玩！\n");
+    print(game, "=====================================\n");
+}
+
+// ========== 字符串池 ==========
+
+uint32_t string_hash(const char *text)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++)
+    {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+// 返回文字在哈希表中的位置，不存在时返回空位置
+uint32_t string_probe(const char *data, const uint32_t *table, uint32_t table_size, const char *text)
+{
+    uint32_t mask = table_size - 1;
+    uint32_t pos = string_hash(text) & mask;
+
+    while (table[pos] && strcmp(data + table[pos] - 1, text) != 0)
+    {
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+// 相同的文字只保存一次，返回编号
+StringId string_intern(StringPool *pool, const char *text)
+{
+    size_t length = strlen(text) + 1;
+
+    if (pool->data == NULL)
+    {
+        // 编号0是空字符串
+        pool->capacity = 4096;
+        pool->data = calloc(pool->capacity, 1);
+        pool->size = 1;
+    }
+    if (text[0] == '\0')
+        return 0;
+
+    // 哈希表保持一半以下的负载
+    if ((pool->count + 1) * 2 > pool->table_size)
+    {
+        uint32_t *old = pool->table;
+        uint32_t old_size = pool->table_size;
+
+        pool->table_size = old_size ? old_size * 2 : 256;
+        pool->table = calloc(pool->table_size, sizeof(uint32_t));
+        for (uint32_t i = 0; i < old_size; i++)
+        {
+            if (old[i])
+            {
+                pool->table[string_probe(pool->data, pool->table, pool->table_size, pool->data + old[i] - 1)] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    uint32_t pos = string_probe(pool->data, pool->table, pool->table_size, text);
+    if (pool->table[pos])
+        return pool->table[pos] - 1;
+
+    while (pool->size + length > pool->capacity)
+    {
+        pool->capacity *= 2;
+        pool->data = realloc(pool->data, pool->capacity);
+    }
+
+    StringId id = pool->size;
+    memcpy(pool->data + id, text, length);
+    pool->size += (uint32_t)length;
+    pool->table[pos] = id + 1;
+    pool->count++;
+    return id;
+}
+
+// 在世界的字符串池中查找，不存在时返回STRING_NOT_FOUND
+StringId string_find(const World *world, const char *text)
+{
+    if (text[0] == '\0')
+        return 0;
+
+    const char *data = (const char *)world + world->text_offset;
+    const uint32_t *table = (const uint32_t *)((const char *)world + world->table_offset);
+    uint32_t pos = string_probe(data, table, world->table_size, text);
+    return table[pos] ? table[pos] - 1 : STRING_NOT_FOUND;
+}
+
+const char *text(const World *world, StringId id)
+{
+    return (const char *)world + world->text_offset + id;
+}
+
+#define INTERN(field) string_intern(strings, (field) ? (field) : "")
+
+// 把定义中的文字放入字符串池，其余数值直接复制
+void build_world(World *world, StringPool *strings, const WorldDef *def)
+{
+    memset(world, 0, sizeof(*world));
+
+    for (int i = 0; i < MAX_SKILLS; i++)
+    {
+        const SkillDef *from = &def->skills[i];
+        Skill *to = &world->skills[i];
+        to->name = INTERN(from->name);
+        to->mp_cost = from->mp_cost;
+        to->damage = from->damage;
+        to->heal = from->heal;
+        to->required_level = from->required_level;
+    }
+
+    // 按学习等级排序，之后任何等级可用的技能都是一个前缀
+    int order[MAX_SKILLS];
+    for (int i = 0; i < MAX_SKILLS; i++)
+    {
+        if (world->skills[i].name == 0)
+            continue; // 没有定义的技能
+
+        int pos = world->skill_count++;
+        while (pos > 0 && world->skills[order[pos - 1]].required_level > world->skills[i].required_level)
+        {
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = i;
+    }
+    for (int k = 0; k < world->skill_count; k++)
+    {
+        world->skill_levels[k] = world->skills[order[k]].required_level;
+        world->skills_up_to[k + 1] = world->skills_up_to[k];
+        skill_set_add(&world->skills_up_to[k + 1], order[k]);
+    }
+
+    for (int i = 0; i < MAX_LOCATIONS; i++)
+    {
+        const LocationDef *from = &def->locations[i];
+        Location *to = &world->locations[i];
+        to->name = INTERN(from->name);
+        to->description = INTERN(from->description);
+        to->type = from->type;
+    }
+
+    for (int i = 0; i < MAX_ENEMIES; i++)
+    {
+        const EnemyDef *from = &def->enemies[i];
+        Enemy *to = &world->enemies[i];
+        to->name = INTERN(from->name);
+        to->hp = from->hp;
+        to->max_hp = from->max_hp;
+        to->attack = from->attack;
+        to->defense = from->defense;
+        to->exp_reward = from->exp_reward;
+        to->gold_reward = from->gold_reward;
+    }
+
+    for (int i = 0; i < MAX_NPCS; i++)
+    {
+        const NpcDef *from = &def->npcs[i];
+        Npc *to = &world->npcs[i];
+        to->name = INTERN(from->name);
+        to->dialog = INTERN(from->dialog);
+        for (int j = 0; j < 5; j++)
+        {
+            to->additional_dialogs[j] = INTERN(from->additional_dialogs[j]);
+        }
+        to->additional_dialogs_count = from->additional_dialogs_count;
+        to->item_to_sell = from->item_to_sell;
+        to->item_price = from->item_price;
+        memcpy(to->shop_items, from->shop_items, sizeof(to->shop_items));
+        to->shop_item_count = from->shop_item_count;
+    }
+
+    for (int i = 0; i < MAX_INVENTORY; i++)
+    {
+        const ItemDef *from = &def->items[i];
+        Item *to = &world->items[i];
+        to->name = INTERN(from->name);
+        to->type = from->type;
+        to->value = from->value;
+        to->price = from->price;
+        to->effect = from->effect != EFFECT_DEFAULT ? from->effect : default_item_effect(from->type);
+        to->args[0] = from->args[0];
+        to->args[1] = from->args[1];
+    }
+
+    for (int i = 0; i < MAX_LOCATIONS; i++)
+    {
+        build_encounter_table(&world->encounters[i], def->encounters[i]);
+    }
+
+    build_location_npcs(world, def);
+
+    for (int i = 0; i < 10; i++)
+    {
+        const QuestDef *from = &def->quests[i];
+        Quest *to = &world->quests[i];
+        to->id = from->id;
+        to->name = INTERN(from->name);
+        to->description = INTERN(from->description);
+        to->completed = from->completed;
+        to->reward_exp = from->reward_exp;
+        to->reward_gold = from->reward_gold;
+        to->reward_item = from->reward_item;
+    }
+}
+
+#undef INTERN
+
+// 建立别名表(Vose的方法)：把每一列的概率补足到1/n，不足的部分由一个概率多出来的列补上
+void build_encounter_table(EncounterTable *table, const EncounterDef *def)
+{
+    uint64_t scaled[MAX_ENCOUNTERS]; // 权重乘以列数，和平均值total比较
+    int small[MAX_ENCOUNTERS], large[MAX_ENCOUNTERS];
+    int small_count = 0, large_count = 0;
+    uint64_t total = 0;
+
+    memset(table, 0, sizeof(*table));
+    for (int i = 0; i < MAX_ENCOUNTERS; i++)
+    {
+        if (def[i].weight > 0)
+        {
+            table->enemies[table->count] = def[i].enemy;
+            scaled[table->count] = (uint64_t)def[i].weight;
+            total += (uint64_t)def[i].weight;
+            table->count++;
+        }
+    }
+
+    for (int i = 0; i < table->count; i++)
+    {
+        scaled[i] *= (uint64_t)table->count;
+        table->aliases[i] = i;
+        if (scaled[i] < total)
+            small[small_count++] = i;
+        else
+            large[large_count++] = i;
+    }
+
+    while (small_count > 0 && large_count > 0)
+    {
+        int less = small[--small_count];
+        int more = large[--large_count];
+
+        table->thresholds[less] = (uint64_t)((double)scaled[less] / (double)total * 4294967296.0);
+        table->aliases[less] = more;
+        scaled[more] -= total - scaled[less];
+        if (scaled[more] < total)
+            small[small_count++] = more;
+        else
+            large[large_count++] = more;
+    }
+
+    // 剩下的列概率正好是1/n（或只差舍入误差）
+    while (large_count > 0)
+    {
+        table->thresholds[large[--large_count]] = 1ull << 32;
+    }
+    while (small_count > 0)
+    {
+        table->thresholds[small[--small_count]] = 1ull << 32;
+    }
+}
+
+// 抽取一个敌人，只有一种敌人时不消耗随机数，这里没有敌人时返回-1
+int draw_encounter(const EncounterTable *table, Rng *rng)
+{
+    if (table->count == 0)
+        return -1;
+    if (table->count == 1)
+        return table->enemies[0];
+
+    // 高32位选列（与rng_below相同），低32位决定是否换成别名
+    uint64_t value = rng_next(rng);
+    int column = (int)(((value >> 32) * (uint64_t)table->count) >> 32);
+    if ((value & 0xFFFFFFFFu) >= table->thresholds[column])
+    {
+        column = table->aliases[column];
+    }
+    return table->enemies[column];
+}
+
+// 由各NPC出现的地点建立地点到NPC的索引，同一地点的NPC按编号排列
+void build_location_npcs(World *world, const WorldDef *def)
+{
+    int counts[MAX_LOCATIONS] = {0};
+
+    for (int i = 0; i < MAX_NPCS; i++)
+    {
+        const NpcDef *npc = &def->npcs[i];
+        for (int j = 0; j < npc->location_count; j++)
+        {
+            if (npc->locations[j] >= 0 && npc->locations[j] < MAX_LOCATIONS)
+                counts[npc->locations[j]]++;
+        }
+    }
+
+    world->npc_offsets[0] = 0;
+    for (int i = 0; i < MAX_LOCATIONS; i++)
+    {
+        world->npc_offsets[i + 1] = world->npc_offsets[i] + counts[i];
+        counts[i] = world->npc_offsets[i]; // 之后用作写入位置
+    }
+
+    for (int i = 0; i < MAX_NPCS; i++)
+    {
+        const NpcDef *npc = &def->npcs[i];
+        for (int j = 0; j < npc->location_count; j++)
+        {
+            if (npc->locations[j] >= 0 && npc->locations[j] < MAX_LOCATIONS)
+                world->location_npcs[counts[npc->locations[j]]++] = i;
+        }
+    }
+}
+
+// 返回某地点可以交谈的NPC编号
+const int *location_npcs(const World *world, int location, int *count)
+{
+    if (location < 0 || location >= MAX_LOCATIONS)
+    {
+        *count = 0;
+        return world->location_npcs;
+    }
+
+    *count = world->npc_offsets[location + 1] - world->npc_offsets[location];
+    return world->location_npcs + world->npc_offsets[location];
+}
+
+// 没有指定效果的物品：武器和防具用于装备，消耗品恢复生命值
+int default_item_effect(int type)
+{
+    switch (type)
+    {
+    case 0:
+        return EFFECT_EQUIP_WEAPON;
+    case 1:
+        return EFFECT_EQUIP_ARMOR;
+    default:
+        return EFFECT_HEAL;
+    }
+}
+
+// 按名称查找世界物品，用于读取存档，找不到时返回-1
+int find_item(const World *world, StringId name)
+{
+    if (name == 0)
+        return -1;
+
+    for (int i = 0; i < MAX_INVENTORY; i++)
+    {
+        if (world->items[i].name == name)
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    SetConsoleOutputCP(65001);
+    GameData game = {0};
+    uint64_t seed = (uint64_t)time(NULL);
+
+    if (argc > 1 && strcmp(argv[1], "--compile-content") == 0)
+    {
+        return compile_content(argc - 2, argv + 2);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--export-content") == 0)
+    {
+        return export_content(argc - 2, argv + 2);
+    }
+
+    // 用内容包代替内置世界，必须是第一个参数
+    const unsigned char *content;
+    size_t content_length;
+    if (argc > 2 && strcmp(argv[1], "--content") == 0)
+    {
+        content_path = argv[2];
+        content = load_content(argv[2], &content_length);
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+    else
+    {
+        content = build_content(&builtin_world_def, &content_length);
+    }
+    if (content == NULL)
+        return 1;
+    current_world = content_world(content);
+    game.world = current_world;
+
+    if (argc > 1 && strcmp(argv[1], "--simulate") == 0)
+    {
+        return run_simulation(argc - 2, argv + 2);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--verify-saves") == 0)
+    {
+        return verify_saves(argc - 2, argv + 2);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0)
+    {
+        return run_replays(argc - 2, argv + 2);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--server") == 0)
+    {
+        return run_server(argc - 2, argv + 2);
+    }
+
+    Input input;
+    Output output = {stdout};
+    Replay replay;
+    FILE *script = NULL;
+    const char *record_path = NULL;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        // 指定随机数种子可以完整重现一局游戏
+        if (strcmp(argv[i], "--seed") == 0)
+        {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        }
+        // 从文件读取操作，文件读完后游戏结束
+        else if (strcmp(argv[i], "--script") == 0)
+        {
+            script = fopen(argv[i + 1], "r");
+            if (script == NULL)
+            {
+                printf("无法打开脚本文件：%s\n", argv[i + 1]);
+                return 1;
+            }
+        }
+        // 把这局游戏的回放写入文件
+        else if (strcmp(argv[i], "--record") == 0)
+        {
+            record_path = argv[i + 1];
+        }
+    }
+
+    input_from_file(&input, script ? script : stdin);
+    game.input = &input;
+    game.output = &output;
+
+    // 读档或创建角色之后才开始录制回放
+    start_game(&game);
+    while (game.menu.id < MENU_MAIN && game_step(&game))
+    {
+    }
+
+    rng_seed(&game.rng, seed);
+    replay_begin(&replay, seed, &game);
+    input.record = &replay;
+
+    run_game(&game);
+
+    if (record_path && !write_replay(&replay, record_path))
+    {
+        printf("无法保存回放：%s\n", record_path);
+    }
+    replay_free(&replay);
+    free(output.data);
+    if (script)
+    {
+        fclose(script);
+    }
+    return 0;
+}
+
+// 开始一局游戏：询问是否读取存档
+void start_game(GameData *game)
+{
+    print(game, "=====================================\n");
+    print(game, "      勇者斗恶龙\n");
+    print(game, "=====================================\n\n");
+
+    print(game, "是否有存档要加载？(y/n): ");
+    game->menu.id = MENU_START;
+}
+
+void start_game_input(GameData *game, char choice)
+{
+    if (choice == 'y' || choice == 'Y')
+    {
+        load_game(game);
+    }
+    else
+    {
+        init_game(game);
+    }
+}
+
+// 处理一次输入，返回0表示游戏已经结束
+int game_step(GameData *game)
+{
+    Menu *menu = &game->menu;
+    int id = menu->id;
+    int choice = 0;
+    char answer = '\0';
+    char word[MAX_NAME_LENGTH];
+
+    // 等待输入之前写出上一次的全部输出
+    output_flush(game->output);
+
+    // 按当前菜单需要的类型读取输入
+    switch (id)
+    {
+    case MENU_QUIT:
+        return 0;
+    case MENU_START:
+    case MENU_INN:
+    case MENU_SHOP_ASK:
+    case MENU_LEARN_ASK:
+        answer = read_char(game->input);
+        break;
+    case MENU_LOAD_NAME:
+    case MENU_NEW_NAME:
+        read_word(game->input, word, sizeof(word));
+        break;
+    default:
+        choice = read_int(game->input);
+        break;
+    }
+
+    if (input_closed(game->input))
+    {
+        menu->id = MENU_QUIT;
+        return 0;
+    }
+
+    // 处理完没有进入其他菜单时回到主菜单
+    menu->id = MENU_MAIN;
+
+    switch (id)
+    {
+    case MENU_START:
+        start_game_input(game, answer);
+        break;
+    case MENU_LOAD_NAME:
+        load_game_name(game, word);
+        break;
+    case MENU_LOAD_SLOT:
+        load_game_slot(game, choice);
+        break;
+    case MENU_NEW_NAME:
+        init_player_name(game, word);
+        break;
+    case MENU_MAIN:
+        main_menu_input(game, choice);
+        break;
+    case MENU_TRAVEL:
+        travel_input(game, choice);
+        break;
+    case MENU_BATTLE:
+        battle_input(game, choice);
+        break;
+    case MENU_BATTLE_SKILL:
+        battle_skill_input(game, choice);
+        break;
+    case MENU_TALK:
+        talk_to_npc_input(game, choice);
+        break;
+    case MENU_INN:
+        inn_input(game, answer);
+        break;
+    case MENU_SHOP_ASK:
+        if (answer == 'y' || answer == 'Y')
+        {
+            shop_menu(game, menu->npc_index);
+        }
+        break;
+    case MENU_LEARN_ASK:
+        if (answer == 'y' || answer == 'Y')
+        {
+            learn_skills(game);
+        }
+        break;
+    case MENU_SHOP:
+        shop_menu_input(game, choice);
+        break;
+    case MENU_USE_ITEM:
+        use_item_input(game, choice);
+        break;
+    case MENU_LEARN:
+        learn_skills_input(game, choice);
+        break;
+    case MENU_SAVE:
+        save_game_input(game, choice);
+        break;
+    case MENU_CHEAT:
+        cheat_game_input(game, choice);
+        break;
+    }
+
+    if (menu->id == MENU_MAIN)
+    {
+        main_menu(game);
+    }
+    return menu->id != MENU_QUIT;
+}
+
+// 一直处理输入直到游戏结束
+void run_game(GameData *game)
+{
+    while (game_step(game))
+    {
+    }
+    output_flush(game->output);
+}
+
+// 初始化
+void init_game(GameData *game)
+{
+    game->dragon_defeated = 0; // 恶龙未被击败
+    game->current_location = 0;
+    game->inventory_count = 0;
+    memset(game->inventory_slots, 0, sizeof(game->inventory_slots));
+    memset(&game->learned_skills, 0, sizeof(game->learned_skills)); // 已学习技能
+    skill_set_add(&game->learned_skills, 0);
+    skill_set_add(&game->learned_skills, 1);
+
+    add_item(game, 0, 1); // 铁剑
+    add_item(game, 1, 1); // 皮甲
+    add_item(game, 2, 1); // 生命药水
+
+    init_player(game);
+}
+
+void init_player(GameData *game)
+{
+    init_player_stats(&game->player);
+
+    print(game, "请输入你的名字: ");
+    game->menu.id = MENU_NEW_NAME;
+}
+
+void init_player_name(GameData *game, const char *name)
+{
+    snprintf(game->player.name, sizeof(game->player.name), "%s", name);
+
+    print(game, "欢迎来到勇者斗恶龙的世界，%s！\n", game->player.name);
+    print(game, "和平与繁荣在这片土地上已持续了数百年，\n但这份宁静被一头突然出现的恶龙打破。\n恶龙所到之处，生灵涂炭，横尸遍野\n无数勇者前去讨伐它，却化作龙巢前的累累白骨。\n而你作为一名勇敢的战士，义无反顾地踏上了解救世界的旅程。");
+}
+
+void init_player_stats(Player *player)
+{
+    player->hp = 120;
+    player->max_hp = 120;
+    player->mp = 60;
+    player->max_mp = 60;
+    player->exp = 0;
+    player->level = 1;
+    player->gold = 20;
+    player->attack = 15;
+    player->defense = 5;
+    player->intelligence = 8;
+    player->agility = 5;
+}
+
+// 估算敌人等级的函数
+int estimate_enemy_level(Enemy *enemy)
+{
+    // 基于敌人的属性估算等级
+    int level_by_hp = enemy->hp / 30;
+    int level_by_attack = enemy->attack / 5;
+
+    int estimated_level = (level_by_hp + level_by_attack) / 2;
+
+    if (estimated_level < 1)
+        estimated_level = 1;
+
+    return estimated_level;
+}
+
+static const FrameSpan main_menu_frame[] = {
+    FRAME_SPAN("\n========== 主菜单 ==========\n"
+               "当前地点：",
+               FIELD_STRING),
+    FRAME_SPAN("\n"
+               "1. 查看状态\n"
+               "2. 移动\n"
+               "3. 寻找敌人\n"
+               "4. 与NPC交谈\n"
+               "5. 查看背包\n"
+               "6. 使用物品\n"
+               "7. 休息\n"
+               "8. 学习技能\n"
+               "9. 保存游戏\n"
+               "0. 退出游戏\n"
+               "请选择: ",
+               FIELD_NONE)};
+
+void main_menu(GameData *game)
+{
+    print_frame(game, FRAME_SPANS(main_menu_frame), text(game->world, game->world->locations[game->current_location].name));
+    game->menu.id = MENU_MAIN;
+}
+
+void main_menu_input(GameData *game, int choice)
+{
+    switch (choice)
+    {
+    case 1:
+        show_status(game);
+        break;
+    case 2:
+        travel(game);
+        break;
+    case 3:
+        battle(game);
+        break;
+    case 4:
+        talk_to_npc(game);
+        break;
+    case 5:
+        show_inventory(game);
+        break;
+    case 6:
+        use_item(game);
+        break;
+    case 7:
+        rest(game);
+        break;
+    case 8:
+        learn_skills(game);
+        break;
+    case 9:
+        save_game(game);
+        break;
+    case 0:
+        print(game, "感谢游玩！再见！\n");
+        game->menu.id = MENU_QUIT;
+        break;
+    case 666:
+        cheat_game(game);
+        break;
+    case 114514:
+        print(game, "哼哼哼啊啊啊啊啊啊啊啊啊啊！！！！！！\n");
+    default:
+        print(game, "无效选择，请重新输入。\n");
+    }
+}
+
+// 状态
+static const FrameSpan status_frame[] = {
+    FRAME_SPAN("\n========== 角色状态 ==========\n"
+               "姓名: ",
+               FIELD_STRING),
+    FRAME_SPAN("\n等级: ", FIELD_INT),
+    FRAME_SPAN("\n经验值: ", FIELD_INT),
+    FRAME_SPAN("/", FIELD_INT),
+    FRAME_SPAN("\n生命值: ", FIELD_INT),
+    FRAME_SPAN("/", FIELD_INT),
+    FRAME_SPAN("\n魔法值: ", FIELD_INT),
+    FRAME_SPAN("/", FIELD_INT),
+    FRAME_SPAN("\n攻击力: ", FIELD_INT),
+    FRAME_SPAN("\n防御力: ", FIELD_INT),
+    FRAME_SPAN("\n敏捷: ", FIELD_INT),
+    FRAME_SPAN("\n智力: ", FIELD_INT),
+    FRAME_SPAN("\n金币: ", FIELD_INT),
+    FRAME_SPAN("\n=============================\n", FIELD_NONE)};
+
+void show_status(GameData *game)
+{
+    Player *player = &game->player;
+
+    print_frame(game, FRAME_SPANS(status_frame), player->name, (int)player->level,
+                (int)player->exp, (int)(player->level * 100), (int)player->hp, (int)player->max_hp,
+                (int)player->mp, (int)player->max_mp, (int)player->attack, (int)player->defense,
+                (int)player->agility, (int)player->intelligence, (int)player->gold);
+}
+
+void travel(GameData *game)
+{
+    int i;
+
+    print(game, "\n========== 可去地点 ==========\n");
+    for (i = 0; i < 14; i++)
+    {
+        if (i != game->current_location)
+        {
+            print(game, "%d. %s - %s\n", i + 1, text(game->world, game->world->locations[i].name), text(game->world, game->world->locations[i].description));
+        }
+    }
+    print(game, "请选择目的地 (输入对应数字): ");
+    game->menu.id = MENU_TRAVEL;
+}
+
+void travel_input(GameData *game, int choice)
+{
+    choice--;
+
+    if (choice >= 0 && choice < 14 && choice != game->current_location)
+    {
+        game->current_location = choice;
+        print(game, "你来到了%s。\n", text(game->world, game->world->locations[game->current_location].name));
+    }
     else if (choice == 666)
     {
-        cheat_game(game);
+        cheat_game(game);
+    }
+    else
+    {
+        print(game, "无效的选择。\n");
+    }
+}
+
+// 根据当前地点选择遭遇的敌人，没有敌人时返回-1
+int choose_enemy(GameData *game)
+{
+    if (game->dragon_defeated && game->current_location == 3)
+        return -1;
+
+    return draw_encounter(&game->world->encounters[game->current_location], &game->rng);
+}
+
+void battle_begin(GameData *game, BattleState *state, int enemy_type)
+{
+    state->enemy = game->world->enemies[enemy_type];
+    state->enemy_type = enemy_type;
+    state->turns = 0;
+    state->result = BATTLE_ONGOING;
+}
+
+// 技能是否已学会且满足等级要求
+int skill_available(GameData *game, int skill_index)
+{
+    return skill_set_has(&game->learned_skills, skill_index) &&
+           game->player.level >= game->world->skills[skill_index].required_level;
+}
+
+// ---------- 技能集合 ----------
+
+#ifdef _MSC_VER
+static int ctz64(uint64_t x)
+{
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return (int)index;
+}
+#define CTZ64(x) ctz64(x)
+#else
+#define CTZ64(x) __builtin_ctzll(x)
+#endif
+
+int skill_set_has(const SkillSet *set, int skill)
+{
+    return (int)((set->bits[skill / 64] >> (skill % 64)) & 1);
+}
+
+void skill_set_add(SkillSet *set, int skill)
+{
+    set->bits[skill / 64] |= 1ull << (skill % 64);
+}
+
+// 按编号从小到大列出集合中的技能，返回个数
+int skill_set_list(const SkillSet *set, int *skills)
+{
+    int count = 0;
+    for (int i = 0; i < SKILL_WORDS; i++)
+    {
+        for (uint64_t bits = set->bits[i]; bits; bits &= bits - 1)
+        {
+            skills[count++] = i * 64 + CTZ64(bits);
+        }
+    }
+    return count;
+}
+
+// 达到指定等级时可以使用的全部技能
+SkillSet skills_for_level(const World *world, long level)
+{
+    int low = 0;
+    int high = world->skill_count;
+
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (world->skill_levels[mid] <= level)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return world->skills_up_to[low];
+}
+
+// 执行一个战斗回合，不做任何输入输出。
+// 返回写入events的事件数量(最多MAX_BATTLE_EVENTS个)，行动无效时返回-1。
+int battle_step(GameData *game, BattleState *state, const BattleAction *action, BattleEvent *events)
+{
+    Player *player = &game->player;
+    Enemy *enemy = &state->enemy;
+    int count = 0;
+    int damage;
+
+    if (state->result != BATTLE_ONGOING)
+        return -1;
+
+    switch (action->type)
+    {
+    case ACTION_ATTACK: // 普通攻击
+        damage = calculate_damage(&game->rng, player->attack, enemy->defense);
+        enemy->hp -= damage;
+        events[count++] = (BattleEvent){EVENT_PLAYER_ATTACK, -1, damage, 0, 0};
+        break;
+
+    case ACTION_SKILL: // 使用技能
+    {
+        if (action->skill_index < 0 || action->skill_index >= MAX_SKILLS ||
+            !skill_available(game, action->skill_index))
+            return -1;
+
+        const Skill *skill = &game->world->skills[action->skill_index];
+
+        // MP不足时不消耗回合
+        if (player->mp < skill->mp_cost)
+        {
+            events[count++] = (BattleEvent){EVENT_NOT_ENOUGH_MP, action->skill_index, 0, 0, 0};
+            return count;
+        }
+
+        player->mp -= skill->mp_cost;
+
+        int intelligence_bonus = player->intelligence / 2; // 智力每2点增加1点技能伤害
+        damage = skill->damage + player->attack + intelligence_bonus;
+        enemy->hp -= damage;
+        events[count++] = (BattleEvent){EVENT_PLAYER_SKILL, action->skill_index, damage, player->attack, intelligence_bonus};
+
+        if (skill->heal > 0)
+        {
+            player->hp += skill->heal;
+            if (player->hp > player->max_hp)
+            {
+                player->hp = player->max_hp;
+            }
+            events[count++] = (BattleEvent){EVENT_SKILL_HEAL, action->skill_index, skill->heal, 0, 0};
+        }
+        break;
+    }
+
+    case ACTION_FLEE: // 逃跑
+        if (state->enemy_type == 3)
+        {
+            events[count++] = (BattleEvent){EVENT_ESCAPE_BLOCKED, -1, 0, 0, 0};
+        }
+        else
+        {
+            int enemy_level = estimate_enemy_level(enemy);
+
+            // 根据等级与敌人等级差计算逃跑率
+            int escape_chance = 50 + (player->level - enemy_level) * 5;
+
+            escape_chance += (player->agility / 10) * 5;
+
+            if (escape_chance < 10)
+                escape_chance = 10;
+            if (escape_chance > 90)
+                escape_chance = 90;
+
+            if (rng_below(&game->rng, 100) < escape_chance)
+            {
+                events[count++] = (BattleEvent){EVENT_ESCAPED, -1, escape_chance, 0, 0};
+                state->turns++;
+                state->result = BATTLE_FLED;
+                return count;
+            }
+            events[count++] = (BattleEvent){EVENT_ESCAPE_FAILED, -1, escape_chance, 0, 0};
+        }
+        break;
+
+    default:
+        return -1;
+    }
+
+    state->turns++;
+
+    if (enemy->hp <= 0)
+    {
+        player->exp += enemy->exp_reward;
+        player->gold += enemy->gold_reward;
+        events[count++] = (BattleEvent){EVENT_ENEMY_DEFEATED, -1, enemy->exp_reward, enemy->gold_reward, 0};
+
+        // 击败恶龙
+        if (state->enemy_type == 3 && !game->dragon_defeated)
+        {
+            game->dragon_defeated = 1;
+            events[count++] = (BattleEvent){EVENT_DRAGON_DEFEATED, -1, 0, 0, 0};
+        }
+
+        int old_level = player->level;
+        while (gain_level(player))
+            ;
+        if (player->level > old_level)
+        {
+            events[count++] = (BattleEvent){EVENT_LEVEL_UP, -1, old_level, player->level, 0};
+        }
+
+        state->result = BATTLE_WON;
+        return count;
+    }
+
+    // 敌人回合
+    int enemy_level = estimate_enemy_level(enemy);
+    int dodge_chance = (player->agility / 5 - enemy_level);
+    if (dodge_chance > 90)
+        dodge_chance = 90;
+    if (dodge_chance < 0)
+        dodge_chance = 0;
+
+    if (rng_below(&game->rng, 100) < dodge_chance)
+    {
+        events[count++] = (BattleEvent){EVENT_DODGED, -1, dodge_chance, 0, 0};
+    }
+    else
+    {
+        damage = calculate_damage(&game->rng, enemy->attack, player->defense);
+        player->hp -= damage;
+        events[count++] = (BattleEvent){EVENT_ENEMY_ATTACK, -1, damage, 0, 0};
+    }
+
+    if (player->hp <= 0)
+    {
+        events[count++] = (BattleEvent){EVENT_PLAYER_DEFEATED, -1, 0, 0, 0};
+        state->result = BATTLE_LOST;
+    }
+
+    return count;
+}
+
+// 显示战斗事件
+void show_battle_events(GameData *game, BattleState *state, BattleEvent *events, int count)
+{
+    Enemy *enemy = &state->enemy;
+
+    for (int i = 0; i < count; i++)
+    {
+        BattleEvent *event = &events[i];
+        const Skill *skill = event->skill >= 0 ? &game->world->skills[event->skill] : NULL;
+
+        switch (event->type)
+        {
+        case EVENT_PLAYER_ATTACK:
+            print(game, "你对%s造成了%d点伤害！\n", text(game->world, enemy->name), event->value);
+            break;
+        case EVENT_PLAYER_SKILL:
+            print(game, "你使用%s对%s造成了%d点伤害！(技能伤害%d + 攻击力%d + 智力加成%d)\n",
+                   text(game->world, skill->name), text(game->world, enemy->name), event->value, skill->damage, event->value2, event->value3);
+            break;
+        case EVENT_SKILL_HEAL:
+            print(game, "你使用%s恢复了%d点生命值！\n", text(game->world, skill->name), event->value);
+            break;
+        case EVENT_NOT_ENOUGH_MP:
+            print(game, "MP不足，无法使用此技能！\n");
+            break;
+        case EVENT_ENEMY_DEFEATED:
+            print(game, "你击败了%s！\n", text(game->world, enemy->name));
+            print(game, "获得了%d经验值和%d金币！\n", event->value, event->value2);
+            break;
+        case EVENT_DRAGON_DEFEATED:
+            show_ending(game);
+            break;
+        case EVENT_LEVEL_UP:
+            for (int level = event->value + 1; level <= event->value2; level++)
+            {
+                show_level_up(game, level);
+            }
+            break;
+        case EVENT_ESCAPE_BLOCKED:
+            print(game, "恶龙的强大气息让你无法移动！\n");
+            break;
+        case EVENT_ESCAPED:
+            print(game, "你成功逃跑了！(逃跑率: %d%%)\n", event->value);
+            break;
+        case EVENT_ESCAPE_FAILED:
+            print(game, "逃跑失败！(逃跑率: %d%%)\n", event->value);
+            break;
+        case EVENT_DODGED:
+            print(game, "%s试图攻击你，但你敏捷地闪避开了！(闪避率: %d%%)\n", text(game->world, enemy->name), event->value);
+            break;
+        case EVENT_ENEMY_ATTACK:
+            print(game, "%s对你造成了%d点伤害！\n", text(game->world, enemy->name), event->value);
+            break;
+        case EVENT_PLAYER_DEFEATED:
+            print(game, "你被%s击败了...\n", text(game->world, enemy->name));
+            print(game, "游戏结束！\n");
+            break;
+        }
+    }
+}
+
+// 战斗系统：遇到敌人时显示战斗菜单，之后由battle_input处理每回合的行动
+void battle(GameData *game)
+{
+    // 如果恶龙已被击败
+    if (game->dragon_defeated && game->current_location == 3)
+    {
+        print(game, "恶龙已经被你击败了，龙之城堡现在是一片废墟。\n");
+        return;
+    }
+
+    int enemy_type = choose_enemy(game);
+    if (enemy_type < 0)
+    {
+        switch (game->current_location)
+        {
+        case 0:
+            print(game, "在村庄里很安全，没有敌人。\n");
+            break;
+        case 4:
+            print(game, "在王城里很安全，没有敌人。\n");
+            break;
+        case 13:
+            print(game, "在魔法学院里很安全，没有敌人。\n");
+            break;
+        }
+        return;
+    }
+
+    BattleState *state = &game->menu.battle;
+    battle_begin(game, state, enemy_type);
+    print(game, "\n遭遇了%s！\n", text(game->world, state->enemy.name));
+
+    battle_menu(game);
+}
+
+static const FrameSpan battle_menu_frame[] = {
+    FRAME_SPAN("\n---------- 战斗信息 ----------\n", FIELD_STRING),
+    FRAME_SPAN(" 生命值: ", FIELD_INT),
+    FRAME_SPAN("/", FIELD_INT),
+    FRAME_SPAN("\n", FIELD_STRING),
+    FRAME_SPAN(" 生命值: ", FIELD_INT),
+    FRAME_SPAN("/", FIELD_INT),
+    FRAME_SPAN("\n魔法值: ", FIELD_INT),
+    FRAME_SPAN("/", FIELD_INT),
+    FRAME_SPAN("\n-----------------------------\n"
+               "1. 普通攻击\n"
+               "2. 使用技能\n"
+               "3. 逃跑\n"
+               "请选择行动: ",
+               FIELD_NONE)};
+
+void battle_menu(GameData *game)
+{
+    BattleState *state = &game->menu.battle;
+    Player *player = &game->player;
+
+    print_frame(game, FRAME_SPANS(battle_menu_frame), text(game->world, state->enemy.name), state->enemy.hp, state->enemy.max_hp,
+                player->name, (int)player->hp, (int)player->max_hp, (int)player->mp, (int)player->max_mp);
+    game->menu.id = MENU_BATTLE;
+}
+
+// 列出当前等级可以使用的技能，返回个数
+int battle_skills(GameData *game, int *skills)
+{
+    SkillSet usable = skills_for_level(game->world, game->player.level);
+
+    // 已学会且等级满足要求
+    for (int i = 0; i < SKILL_WORDS; i++)
+    {
+        usable.bits[i] &= game->learned_skills.bits[i];
+    }
+    return skill_set_list(&usable, skills);
+}
+
+void battle_input(GameData *game, int choice)
+{
+    BattleAction action = {0, -1};
+
+    switch (choice)
+    {
+    case 1: // 普通攻击
+        action.type = ACTION_ATTACK;
+        break;
+
+    case 2: // 使用技能
+    {
+        print(game, "\n可用技能:\n");
+        int available_skills[MAX_SKILLS];
+        int skill_count = battle_skills(game, available_skills);
+
+        for (int i = 0; i < skill_count; i++)
+        {
+            const Skill *skill = &game->world->skills[available_skills[i]];
+            if (game->player.mp >= skill->mp_cost)
+            {
+                print(game, "%d. %s (消耗%d MP)\n", i + 1, text(game->world, skill->name), skill->mp_cost);
+            }
+            else
+            {
+                print(game, "%d. %s (消耗%d MP) [MP不足]\n", i + 1, text(game->world, skill->name), skill->mp_cost);
+            }
+        }
+
+        if (skill_count == 0)
+        {
+            print(game, "你目前没有可以使用的技能！\n");
+            battle_menu(game);
+            return;
+        }
+
+        print(game, "请选择技能 (0返回): ");
+        game->menu.id = MENU_BATTLE_SKILL;
+        return;
+    }
+
+    case 3: // 逃跑
+        action.type = ACTION_FLEE;
+        break;
+
+    default:
+        print(game, "无效的选择。\n");
+        battle_menu(game);
+        return;
+    }
+
+    battle_action(game, &action);
+}
+
+void battle_skill_input(GameData *game, int choice)
+{
+    int available_skills[MAX_SKILLS];
+    int skill_count = battle_skills(game, available_skills);
+
+    if (choice == 0)
+    {
+        battle_menu(game);
+        return;
+    }
+
+    choice--;
+
+    if (choice < 0 || choice >= skill_count)
+    {
+        print(game, "无效的技能选择。\n");
+        battle_menu(game);
+        return;
+    }
+
+    BattleAction action = {ACTION_SKILL, available_skills[choice]};
+    battle_action(game, &action);
+}
+
+// 执行一个回合，战斗结束后回到主菜单，失败时游戏结束
+void battle_action(GameData *game, const BattleAction *action)
+{
+    BattleState *state = &game->menu.battle;
+    BattleEvent events[MAX_BATTLE_EVENTS];
+
+    int event_count = battle_step(game, state, action, events);
+    if (event_count > 0)
+    {
+        show_battle_events(game, state, events, event_count);
+    }
+
+    if (state->result == BATTLE_ONGOING)
+    {
+        battle_menu(game);
+    }
+    else if (state->result == BATTLE_LOST)
+    {
+        game->menu.id = MENU_QUIT;
+    }
+}
+
+void rest(GameData *game)
+{
+
+    if (game->world->locations[game->current_location].type == 0 ||
+        game->world->locations[game->current_location].type == 4)
+    {
+        int restore_hp = game->player.max_hp - game->player.hp;
+        int restore_mp = game->player.max_mp - game->player.mp;
+
+        game->player.hp = game->player.max_hp;
+        game->player.mp = game->player.max_mp;
+
+        print(game, "你在这里好好休息了一番...\n");
+        print(game, "恢复了%d点生命值和%d点魔法值！\n", restore_hp, restore_mp);
+    }
+    else
+    {
+        print(game, "只有在城镇或安全地点才能安全地休息！\n");
+    }
+}
+
+// 经验足够时提升一级，返回是否升级
+int gain_level(Player *player)
+{
+    if (player->exp < player->level * 100)
+        return 0;
+
+    player->level++;
+    player->max_hp += 20;
+    player->hp = player->max_hp;
+    player->max_mp += 10;
+    player->mp = player->max_mp;
+    player->attack += 5;
+    player->defense += 2;
+    player->agility += 3;
+    player->intelligence += 2;
+    return 1;
+}
+
+void show_level_up(GameData *game, int level)
+{
+    print(game, "恭喜升级到 %d 级！\n", level);
+    print(game, "生命值 +%d，魔法值 +%d  ", 20, 10);
+    print(game, "攻击力 +%d，防御力 +%d  ", 5, 2);
+    print(game, "敏捷 +%d，智力 +%d\n", 3, 2);
+}
+
+void level_up(GameData *game)
+{
+    while (gain_level(&game->player))
+    {
+        show_level_up(game, game->player.level);
+    }
+}
+
+int calculate_damage(Rng *rng, int attacker_attack, int defender_defense)
+{
+    int base_damage = attacker_attack - (defender_defense / 2);
+    if (base_damage < 1)
+        base_damage = 1;
+
+    int variance = base_damage / 4;
+    if (variance < 1)
+        variance = 1;
+
+    int final_damage = base_damage + rng_below(rng, variance * 2) - variance;
+    if (final_damage < 1)
+        final_damage = 1;
+
+    return final_damage;
+}
+
+// 随机数
+uint64_t rng_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+// 用splitmix64展开种子，保证状态不全为0
+void rng_seed(Rng *rng, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+uint64_t rng_next(Rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+
+    return result;
+}
+
+// 返回[0, bound)内的随机整数，用乘法代替取模
+int rng_below(Rng *rng, int bound)
+{
+    return (int)(((rng_next(rng) >> 32) * (uint64_t)bound) >> 32);
+}
+
+// 批量生成随机数
+void rng_fill(Rng *rng, uint64_t *out, size_t count)
+{
+    Rng local = *rng;
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = rng_next(&local);
+    }
+    *rng = local;
+}
+
+void load_game(GameData *game)
+{
+    print(game, "请输入角色名: ");
+    game->menu.id = MENU_LOAD_NAME;
+}
+
+void load_game_name(GameData *game, const char *player)
+{
+    snprintf(game->menu.player, sizeof(game->menu.player), "%s", player);
+
+    if (show_save_slots(game, player, 0) == 0)
+    {
+        print(game, "没有找到%s的存档。\n", player);
+        load_game_failed(game);
+        return;
+    }
+
+    print(game, "请选择存档栏位 (1-%d): ", SAVE_SLOTS);
+    game->menu.id = MENU_LOAD_SLOT;
+}
+
+void load_game_slot(GameData *game, int slot)
+{
+    int status = load_from_slot(game, game->menu.player, slot);
+    if (status == SAVE_NOT_FOUND)
+    {
+        print(game, "无法加载游戏。\n");
+        load_game_failed(game);
+        return;
+    }
+    if (status != SAVE_OK)
+    {
+        print(game, "存档已损坏，无法加载。(%s)\n", save_status_text(status));
+        load_game_failed(game);
+        return;
+    }
+
+    print(game, "游戏已加载。\n");
+    print(game, "欢迎回来，%s！\n", game->player.name);
+}
+
+void load_game_failed(GameData *game)
+{
+    print(game, "未找到存档文件，开始新游戏。\n");
+    init_game(game);
+}
+
+void talk_to_npc(GameData *game)
+{
+    int npc_count;
+    const int *npcs = location_npcs(game->world, game->current_location, &npc_count);
+
+    if (npc_count == 0)
+    {
+        print(game, "这里没有可以交谈的NPC。\n");
+        return;
+    }
+
+    print(game, "==========可以交谈的NPC==========\n");
+    for (int i = 0; i < npc_count; i++)
+    {
+        print(game, "%d. %s\n", i + 1, text(game->world, game->world->npcs[npcs[i]].name));
+    }
+    print(game, "请选择要交谈的NPC：\n");
+
+    game->menu.id = MENU_TALK;
+}
+
+void talk_to_npc_input(GameData *game, int choice)
+{
+    int npc_count;
+    const int *npcs = location_npcs(game->world, game->current_location, &npc_count);
+
+    if (choice == 0)
+        return;
+
+    choice--;
+
+    if (choice >= 0 && choice < npc_count)
+    {
+        int npc_index = npcs[choice];
+
+        // 根据恶龙是否被击败显示不同的对话
+        if (game->dragon_defeated &&
+            (npc_index == 1 || npc_index == 5 || npc_index == 16 || npc_index == 19))
+        {
+            // 恶龙被击败后
+            switch (npc_index)
+            {
+            case 1: // 村长
+                print(game, "\n%s: \"伟大的勇者！你拯救了我们所有人！\"", text(game->world, game->world->npcs[npc_index].name));
+                print(game, "\n%s: \"整个村庄都在庆祝你的胜利！\"", text(game->world, game->world->npcs[npc_index].name));
+                break;
+            case 5: // 国王
+                print(game, "\n%s: \"伟大的英雄！您拯救了整个王国！人民将永远铭记你的功绩。\"", text(game->world, game->world->npcs[npc_index].name));
+                print(game, "\n%s: \"王国的和平与繁荣都归功于你！\"", text(game->world, game->world->npcs[npc_index].name));
+                print(game, "\n%s: \"你的事迹将被各地传颂。\"", text(game->world, game->world->npcs[npc_index].name));
+                break;
+            case12: // 赏金猎人
+                print(game, "\n%s:恭喜！你我都圆满完成各自的使命！", text(game->world, game->world->npcs[npc_index].name));
+            case 14: // 占卜师
+                print(game, "\n%s: \"你果然做到了，打破了既定的命运！\"", text(game->world, game->world->npcs[npc_index].name));
+                print(game, "\n%s: \"但你仍需小心前方的道路。\"", text(game->world, game->world->npcs[npc_index].name));
+            case 16: // 村民
+                print(game, "\n%s: \"英雄！感谢你拯救了我们的村庄！\"", text(game->world, game->world->npcs[npc_index].name));
+                print(game, "\n%s: \"你将是我们传说中永远的英雄！\"", text(game->world, game->world->npcs[npc_index].name));
+                break;
+            case 17: // 老者
+                print(game, "\n%s: \"力量会随岁月流逝，但勇气不会。！\"", text(game->world, game->world->npcs[npc_index].name));
+            case 19: // 神秘女子
+                print(game, "\n%s: \"命运的轨迹已经改变，光明重新回到了这个世界。\"", text(game->world, game->world->npcs[npc_index].name));
+                print(game, "\n%s: \"你的勇气将被永远铭记\"", text(game->world, game->world->npcs[npc_index].name));
+                break;
+            }
+        }
+        else
+        {
+            print(game, "\n%s: \"%s\"\n", text(game->world, game->world->npcs[npc_index].name), text(game->world, game->world->npcs[npc_index].dialog));
+
+            for (int i = 0; i < game->world->npcs[npc_index].additional_dialogs_count; i++)
+            {
+                print(game, "%s: \"%s\"\n", text(game->world, game->world->npcs[npc_index].name), text(game->world, game->world->npcs[npc_index].additional_dialogs[i]));
+            }
+        }
+
+        if (npc_index == 18)
+        {
+            print(game, "\n%s: \"在我的旅店里休息一晚，就可以完全恢复你的全部状态。\"", text(game->world, game->world->npcs[npc_index].name));
+            print(game, "\n是否要休息一晚？(y/n): ");
+            game->menu.npc_index = npc_index;
+            game->menu.id = MENU_INN;
+            return;
+        }
+
+        if (npc_index == 0 || npc_index == 2 || npc_index == 3 || npc_index == 8 || npc_index == 9 || npc_index == 13)
+        {
+            print(game, "\n%s愿意与你交易。\n", text(game->world, game->world->npcs[npc_index].name));
+            print(game, "是否要看看他的商品？(y/n): ");
+            game->menu.npc_index = npc_index;
+            game->menu.id = MENU_SHOP_ASK;
+        }
+        else if (npc_index == 4)
+        {
+            print(game, "\n%s可以教你新技能。\n", text(game->world, game->world->npcs[npc_index].name));
+            print(game, "是否要学习新技能？(y/n): ");
+            game->menu.id = MENU_LEARN_ASK;
+        }
+    }
+    else
+    {
+        print(game, "无效的选择。\n");
+    }
+}
+
+void inn_input(GameData *game, char choice)
+{
+    int npc_index = game->menu.npc_index;
+
+    if (choice == 'y' || choice == 'Y')
+    {
+        if (game->player.gold >= game->world->npcs[npc_index].item_price)
+        {
+            game->player.gold -= game->world->npcs[npc_index].item_price;
+            int restore_hp = game->player.max_hp - game->player.hp;
+            int restore_mp = game->player.max_mp - game->player.mp;
+            game->player.hp = game->player.max_hp;
+            game->player.mp = game->player.max_mp;
+            print(game, "你在旅店里好好休息了一番...\n");
+            print(game, "恢复了%d点生命值和%d点魔法值！\n", restore_hp, restore_mp);
+        }
+    }
+}
+
+void shop_menu(GameData *game, int npc_index)
+{
+    const Npc *npc = &game->world->npcs[npc_index];
+
+    print(game, "\n========== %s的商店 ==========\n", text(game->world, npc->name));
+    for (int i = 0; i < npc->shop_item_count; i++)
+    {
+        int item_index = npc->shop_items[i];
+        const Item *item = &game->world->items[item_index];
+        print(game, "%d. %s - %d金币 ", i + 1, text(game->world, item->name), item->price);
+        switch (item->type)
+        {
+        case 0:
+            print(game, "(武器: +%d攻击)", item->value);
+            break;
+        case 1:
+            print(game, "(防具: +%d防御)", item->value);
+            break;
+        case 2:
+            print(game, "(消耗品: 恢复%d HP)", item->value);
+            break;
+        }
+        print(game, "\n");
+    }
+    print(game, "你有%d金币。\n", game->player.gold);
+    print(game, "请选择要购买的物品 (0返回): ");
+    game->menu.npc_index = npc_index;
+    game->menu.id = MENU_SHOP;
+}
+
+void shop_menu_input(GameData *game, int choice)
+{
+    const Npc *npc = &game->world->npcs[game->menu.npc_index];
+
+    if (choice == 0)
+        return;
+
+    choice--;
+
+    if (choice >= 0 && choice < npc->shop_item_count)
+    {
+        int item_index = npc->shop_items[choice];
+        const Item *item = &game->world->items[item_index];
+
+        if (game->player.gold >= item->price)
+        {
+            if (add_item(game, item_index, 1))
+            {
+                game->player.gold -= item->price;
+                print(game, "你购买了%s！\n", text(game->world, item->name));
+            }
+            else
+            {
+                print(game, "背包已满！\n");
+            }
+        }
+        else
+        {
+            print(game, "金币不足！\n");
+        }
+    }
+    else
+    {
+        print(game, "无效的选择。\n");
+    }
+}
+
+void show_inventory(GameData *game)
+{
+    print(game, "\n========== 背包 ==========\n");
+    if (game->inventory_count == 0)
+    {
+        print(game, "背包是空的。\n");
+    }
+    else
+    {
+        for (int i = 0; i < game->inventory_count; i++)
+        {
+            const ItemStack *stack = &game->inventory[i];
+            const Item *item = &game->world->items[stack->item];
+
+            print(game, "%d. %s", i + 1, text(game->world, item->name));
+            if (stack->count > 1)
+            {
+                print(game, " x%d", stack->count);
+            }
+            switch (item->type)
+            {
+            case 0:
+                print(game, " (武器: +%d攻击)", item->value);
+                break;
+            case 1:
+                print(game, " (防具: +%d防御)", item->value);
+                break;
+            case 2:
+                print(game, " (消耗品: 恢复%d HP)", item->value);
+                break;
+            }
+            print(game, "\n");
+        }
+    }
+    print(game, "========================\n");
+}
+
+void use_item(GameData *game)
+{
+    if (game->inventory_count == 0)
+    {
+        print(game, "背包是空的。\n");
+        return;
+    }
+
+    show_inventory(game);
+    print(game, "请选择要使用的物品 (输入编号，0取消): ");
+    game->menu.id = MENU_USE_ITEM;
+}
+
+// ---------- 背包 ----------
+
+// 放入背包，同种物品叠放，已满时返回0
+int add_item(GameData *game, int item, int count)
+{
+    int slot = game->inventory_slots[item];
+
+    if (slot)
+    {
+        ItemStack *stack = &game->inventory[slot - 1];
+        if (stack->count > MAX_STACK_COUNT - count)
+            return 0;
+        stack->count += count;
+        return 1;
+    }
+
+    if (game->inventory_count >= MAX_INVENTORY || count > MAX_STACK_COUNT)
+        return 0;
+
+    game->inventory[game->inventory_count].item = item;
+    game->inventory[game->inventory_count].count = count;
+    game->inventory_count++;
+    game->inventory_slots[item] = (unsigned char)game->inventory_count;
+    return 1;
+}
+
+// 取出一件，最后一件取出后把最后一格移到这里
+void remove_item(GameData *game, int slot)
+{
+    ItemStack *stack = &game->inventory[slot];
+
+    if (--stack->count > 0)
+        return;
+
+    game->inventory_slots[stack->item] = 0;
+    game->inventory_count--;
+    if (slot != game->inventory_count)
+    {
+        *stack = game->inventory[game->inventory_count];
+        game->inventory_slots[stack->item] = (unsigned char)(slot + 1);
+    }
+}
+
+// ---------- 物品效果 ----------
+
+void equip_weapon(GameData *game, const Item *item)
+{
+    print(game, "你装备了%s，增加了%d点攻击力！\n", text(game->world, item->name), item->value);
+}
+
+void equip_armor(GameData *game, const Item *item)
+{
+    print(game, "你装备了%s，增加了%d点防御力！\n", text(game->world, item->name), item->value);
+}
+
+void heal_item(GameData *game, const Item *item)
+{
+    game->player.hp += item->value;
+    if (game->player.hp > game->player.max_hp)
+    {
+        game->player.hp = game->player.max_hp;
+    }
+    print(game, "你使用了%s，恢复了%d点生命值！\n", text(game->world, item->name), item->value);
+}
+
+void attack_up_item(GameData *game, const Item *item)
+{
+    game->player.attack += item->args[0];
+    print(game, "你使用了%s，永久增加了%d点攻击力！\n", text(game->world, item->name), item->args[0]);
+}
+
+void agility_up_item(GameData *game, const Item *item)
+{
+    game->player.agility += item->args[0];
+    print(game, "你使用了%s，永久增加了%d点敏捷！\n", text(game->world, item->name), item->args[0]);
+}
+
+void intelligence_up_item(GameData *game, const Item *item)
+{
+    game->player.intelligence += item->args[0];
+    game->player.max_mp += item->args[1];
+    game->player.mp += item->args[1];
+    if (game->player.mp > game->player.max_mp)
+    {
+        game->player.mp = game->player.max_mp;
+    }
+    print(game, "你使用了%s，永久增加了%d点智力和%d点最大魔法值！\n", text(game->world, item->name), item->args[0], item->args[1]);
+}
+
+static const ItemEffectFunc item_effects[ITEM_EFFECTS] = {
+    [EFFECT_EQUIP_WEAPON] = equip_weapon,
+    [EFFECT_EQUIP_ARMOR] = equip_armor,
+    [EFFECT_HEAL] = heal_item,
+    [EFFECT_ATTACK_UP] = attack_up_item,
+    [EFFECT_AGILITY_UP] = agility_up_item,
+    [EFFECT_INTELLIGENCE_UP] = intelligence_up_item,
+};
+
+void use_item_input(GameData *game, int choice)
+{
+    if (choice == 0)
+        return;
+
+    choice--;
+
+    if (choice >= 0 && choice < game->inventory_count)
+    {
+        const Item *item = &game->world->items[game->inventory[choice].item];
+
+        if (item->effect > EFFECT_DEFAULT && item->effect < ITEM_EFFECTS)
+        {
+            item_effects[item->effect](game, item);
+        }
+
+        // 使用或装备后移除物品
+        remove_item(game, choice);
+    }
+    else
+    {
+        print(game, "无效的选择。\n");
+    }
+}
+
+void save_game(GameData *game)
+{
+    print(game, "\n===== 保存游戏 =====\n");
+    // 回放时不读写存档目录
+    if (!input_replaying(game->input))
+    {
+        show_save_slots(game, game->player.name, 1);
+    }
+    print(game, "请选择存档栏位 (1-%d，0返回): ", SAVE_SLOTS);
+    game->menu.id = MENU_SAVE;
+}
+
+void save_game_input(GameData *game, int slot)
+{
+    if (slot == 0)
+        return;
+    if (slot < 1 || slot > SAVE_SLOTS)
+    {
+        print(game, "无效的选择！\n");
+        return;
+    }
+    if (input_replaying(game->input))
+        return;
+
+    // 只保存会变化的数据，世界数据不写入存档
+    if (!save_to_slot(game, slot))
+    {
+        print(game, "无法保存游戏！\n");
+        return;
+    }
+
+    print(game, "游戏已保存。\n");
+}
+
+// ========== 输入 ==========
+// 所有菜单都通过Input读取玩家的选择，解析规则与scanf相同：
+// 跳过空白后读取一个整数、一个字符或一个单词。输入结束后整数返回0，字符返回'\0'。
+
+int file_source(void *context, char *buffer, int size)
+{
+    // 按行读取，交互时每次回车就能拿到输入
+    if (fgets(buffer, size, (FILE *)context) == NULL)
+        return 0;
+    return (int)strlen(buffer);
+}
+
+void input_init(Input *input, InputSource source, void *context)
+{
+    input->source = source;
+    input->context = context;
+    input->data = input->buffer;
+    input->length = 0;
+    input->pos = 0;
+    input->eof = 0;
+    input->closed = 0;
+    input->record = NULL;
+    input->replay.data = NULL;
+    input->replay.size = 0;
+    input->replay.pos = 0;
+    input->replay.error = 0;
+    input->diverged = 0;
+}
+
+void input_from_file(Input *input, FILE *file)
+{
+    input_init(input, file_source, file);
+}
+
+// 脚本需要在输入结束前保持有效
+void input_from_string(Input *input, const char *script)
+{
+    input_init(input, NULL, NULL);
+    input->data = script;
+    input->length = (int)strlen(script);
+}
+
+int input_closed(const Input *input)
+{
+    return input->closed;
+}
+
+// 把未读的内容移到缓冲区开头，再从来源追加数据。
+// 返回追加的字节数，0表示输入结束，-1表示暂时没有数据
+int input_fill(Input *input)
+{
+    if (input->eof || input->source == NULL)
+    {
+        input->eof = 1;
+        return 0;
+    }
+
+    int unread = input->length - input->pos;
+    memmove(input->buffer, input->data + input->pos, unread);
+    input->data = input->buffer;
+    input->length = unread;
+    input->pos = 0;
+
+    int length = input->source(input->context, input->buffer + unread, (int)sizeof(input->buffer) - unread);
+    if (length == 0)
+    {
+        input->eof = 1;
+        return 0;
+    }
+    if (length < 0)
+        return -1;
+
+    input->length += length;
+    return length;
+}
+
+// 返回下一个字符但不读走，输入结束时返回EOF
+int input_peek(Input *input)
+{
+    while (input->pos >= input->length)
+    {
+        if (input_fill(input) <= 0)
+            return EOF;
+    }
+    return (unsigned char)input->data[input->pos];
+}
+
+// 下一个单词已经完整收到时返回1，非阻塞的来源暂时没有足够数据时返回0
+int input_ready(Input *input)
+{
+    if (input->replay.data)
+        return 1;
+
+    int i = input->pos;
+    int started = 0;
+    for (;;)
+    {
+        if (i >= input->length)
+        {
+            // 缓冲区已满时把已有的部分当作完整的单词
+            if (input->length - input->pos == (int)sizeof(input->buffer))
+                return 1;
+
+            int offset = i - input->pos;
+            int length = input_fill(input);
+            if (length < 0)
+                return 0;
+            if (length == 0)
+                return 1;
+            i = input->pos + offset;
+            continue;
+        }
+
+        int ch = (unsigned char)input->data[i];
+        if (isspace(ch))
+        {
+            if (started)
+                return 1;
+        }
+        else
+        {
+            started = 1;
+        }
+        i++;
+    }
+}
+
+int input_skip_space(Input *input)
+{
+    int ch;
+    while ((ch = input_peek(input)) != EOF && isspace(ch))
+    {
+        input->pos++;
+    }
+    return ch;
+}
+
+// 读取整数，不是数字时丢弃这个单词并返回-1
+int read_int(Input *input)
+{
+    int sign = 1;
+    int digits = 0;
+    long value = 0;
+
+    if (input->replay.data)
+    {
+        uint64_t packed;
+        if (!replay_next(input, REPLAY_INT, &packed))
+            return 0;
+        return (int)((int64_t)(packed >> 1) ^ -(int64_t)(packed & 1));
+    }
+
+    int ch = input_skip_space(input);
+    if (ch == EOF)
+    {
+        input->closed = 1;
+        return 0;
+    }
+
+    if (ch == '+' || ch == '-')
+    {
+        sign = ch == '-' ? -1 : 1;
+        input->pos++;
+    }
+    while ((ch = input_peek(input)) != EOF && isdigit(ch))
+    {
+        if (value < 100000000)
+        {
+            value = value * 10 + (ch - '0');
+        }
+        input->pos++;
+        digits++;
+    }
+
+    if (digits == 0)
+    {
+        while ((ch = input_peek(input)) != EOF && !isspace(ch))
+        {
+            input->pos++;
+        }
+        value = 1;
+        sign = -1;
+    }
+
+    int result = (int)(sign * value);
+    if (input->record)
+    {
+        int64_t wide = result;
+        replay_put(input->record, REPLAY_INT, ((uint64_t)wide << 1) ^ (uint64_t)(wide >> 63), NULL);
+    }
+    return result;
+}
+
+char read_char(Input *input)
+{
+    if (input->replay.data)
+    {
+        uint64_t packed;
+        if (!replay_next(input, REPLAY_CHAR, &packed))
+            return '\0';
+        return (char)packed;
+    }
+
+    int ch = input_skip_space(input);
+    if (ch == EOF)
+    {
+        input->closed = 1;
+        return '\0';
+    }
+    input->pos++;
+
+    if (input->record)
+    {
+        replay_put(input->record, REPLAY_CHAR, (unsigned char)ch, NULL);
+    }
+    return (char)ch;
+}
+
+void read_word(Input *input, char *buffer, size_t size)
+{
+    size_t length = 0;
+
+    if (input->replay.data)
+    {
+        uint64_t packed;
+        buffer[0] = '\0';
+        if (replay_next(input, REPLAY_WORD, &packed))
+        {
+            SaveReader *reader = &input->replay;
+            for (uint64_t i = 0; i < packed; i++)
+            {
+                unsigned ch = get_u8(reader);
+                if (length + 1 < size)
+                {
+                    buffer[length++] = (char)ch;
+                }
+            }
+            buffer[length] = '\0';
+        }
+        return;
+    }
+
+    int ch = input_skip_space(input);
+    if (ch == EOF)
+    {
+        input->closed = 1;
+    }
+    while (ch != EOF && !isspace(ch))
+    {
+        if (length + 1 < size)
+        {
+            buffer[length++] = (char)ch;
+        }
+        input->pos++;
+        ch = input_peek(input);
+    }
+    buffer[length] = '\0';
+
+    if (input->record && !input->closed)
+    {
+        replay_put(input->record, REPLAY_WORD, 0, buffer);
+    }
+}
+
+// ========== 输出 ==========
+
+void print(GameData *game, const char *format, ...)
+{
+    Output *output = game->output;
+    va_list args;
+
+    va_start(args, format);
+    if (output->file || output->capture)
+    {
+        output_append(output, format, args);
+    }
+    va_end(args);
+}
+
+void output_append(Output *output, const char *format, va_list args)
+{
+    va_list copy;
+    int length;
+
+    // 大多数情况下剩余空间足够，只需格式化一次
+    va_copy(copy, args);
+    if (output->capacity > output->size)
+    {
+        length = vsnprintf(output->data + output->size, output->capacity - output->size, format, copy);
+    }
+    else
+    {
+        length = vsnprintf(NULL, 0, format, copy);
+    }
+    va_end(copy);
+    if (length < 0)
+        return;
+    if (output->size + (size_t)length < output->capacity)
+    {
+        output->size += (size_t)length;
+        return;
+    }
+
+    if (!output_reserve(output, (size_t)length + 1))
+        return;
+
+    vsnprintf(output->data + output->size, output->capacity - output->size, format, args);
+    output->size += (size_t)length;
+}
+
+// 保证还能写入length个字节
+int output_reserve(Output *output, size_t length)
+{
+    size_t needed = output->size + length;
+    if (needed <= output->capacity)
+        return 1;
+
+    size_t capacity = output->capacity ? output->capacity * 2 : 4096;
+    while (capacity < needed)
+    {
+        capacity *= 2;
+    }
+    char *data = realloc(output->data, capacity);
+    if (data == NULL)
+        return 0;
+    output->data = data;
+    output->capacity = capacity;
+    return 1;
+}
+
+void output_write(Output *output, const char *data, size_t length)
+{
+    if (!output_reserve(output, length))
+        return;
+
+    memcpy(output->data + output->size, data, length);
+    output->size += length;
+}
+
+// 输出预先拼好的画面，依次复制每段文本并填入字段，结果与同样内容的printf完全相同
+void print_frame(GameData *game, const FrameSpan *spans, int count, ...)
+{
+    Output *output = game->output;
+    va_list args;
+
+    if (!output->file && !output->capture)
+        return;
+
+    va_start(args, count);
+    for (int i = 0; i < count; i++)
+    {
+        const FrameSpan *span = &spans[i];
+        output_write(output, span->text, span->length);
+
+        if (span->field == FIELD_INT)
+        {
+            char digits[16];
+            char *end = digits + sizeof(digits);
+            char *p = end;
+            int value = va_arg(args, int);
+            unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+
+            do
+            {
+                *--p = (char)('0' + magnitude % 10);
+                magnitude /= 10;
+            } while (magnitude);
+            if (value < 0)
+            {
+                *--p = '-';
+            }
+            output_write(output, p, (size_t)(end - p));
+        }
+        else if (span->field == FIELD_STRING)
+        {
+            const char *text = va_arg(args, const char *);
+            output_write(output, text, strlen(text));
+        }
+    }
+    va_end(args);
+}
+
+// 把这次交互的全部输出一次写入文件
+void output_flush(Output *output)
+{
+    if (output->file == NULL || output->size == 0)
+        return;
+
+    fwrite(output->data, 1, output->size, output->file);
+    fflush(output->file);
+    output->size = 0;
+}
+
+// ========== 回放 ==========
+// 回放文件使用与存档相同的头部(魔数"DQRP")，内容为:
+//   随机数种子 | 开始时的存档长度 | 开始时的存档 | 输入...
+// 每个输入是一个varint，低2位是类型，其余位是值；单词的值是长度，后面跟着内容。
+// 回放时游戏按同样的顺序请求输入，类型不一致说明游戏逻辑与录制时不同。
+
+void replay_begin(Replay *replay, uint64_t seed, const GameData *game)
+{
+    replay->seed = seed;
+    replay->start_length = save_encode(game, replay->start, sizeof(replay->start));
+    replay->data = NULL;
+    replay->size = 0;
+    replay->capacity = 0;
+}
+
+void replay_free(Replay *replay)
+{
+    free(replay->data);
+    replay->data = NULL;
+    replay->size = 0;
+    replay->capacity = 0;
+}
+
+void replay_put(Replay *replay, int type, uint64_t value, const char *text)
+{
+    size_t length = text ? strlen(text) : 0;
+    size_t needed = replay->size + 10 + length;
+
+    if (needed > replay->capacity)
+    {
+        size_t capacity = replay->capacity ? replay->capacity * 2 : 1024;
+        while (capacity < needed)
+        {
+            capacity *= 2;
+        }
+        unsigned char *data = realloc(replay->data, capacity);
+        if (data == NULL)
+            return;
+        replay->data = data;
+        replay->capacity = capacity;
+    }
+
+    SaveWriter writer = {replay->data, replay->capacity, replay->size, 0};
+    if (text)
+    {
+        value = length;
+    }
+    put_varint(&writer, (value << 2) | (uint64_t)type);
+    put_bytes(&writer, text, length);
+    replay->size = writer.size;
+}
+
+// 编码到新分配的缓冲区中
+unsigned char *replay_encode(const Replay *replay, size_t *length)
+{
+    size_t capacity = SAVE_HEADER_SIZE + 20 + replay->start_length + replay->size;
+    unsigned char *buffer = malloc(capacity);
+    if (buffer == NULL)
+        return NULL;
+
+    SaveWriter writer = {buffer, capacity, SAVE_HEADER_SIZE, 0};
+    put_varint(&writer, replay->seed);
+    put_varint(&writer, replay->start_length);
+    put_bytes(&writer, replay->start, replay->start_length);
+    put_bytes(&writer, replay->data, replay->size);
+
+    *length = finish_header(&writer, "DQRP", REPLAY_VERSION);
+    return buffer;
+}
+
+// 交给后台线程写入
+int write_replay(const Replay *replay, const char *path)
+{
+    size_t length;
+    unsigned char *buffer = replay_encode(replay, &length);
+    if (buffer == NULL)
+        return 0;
+
+    int ok = save_queue_push(path, buffer, length);
+    free(buffer);
+    return ok;
+}
+
+void input_from_replay(Input *input, const unsigned char *data, size_t length)
+{
+    input_init(input, NULL, NULL);
+    input->replay.data = data;
+    input->replay.size = length;
+}
+
+int input_replaying(const Input *input)
+{
+    return input->replay.data != NULL;
+}
+
+int replay_next(Input *input, int type, uint64_t *value)
+{
+    SaveReader *reader = &input->replay;
+
+    if (input->closed || reader->pos >= reader->size)
+    {
+        input->closed = 1;
+        return 0;
+    }
+
+    uint64_t packed = get_varint(reader);
+    if (reader->error || (int)(packed & 3) != type)
+    {
+        input->diverged = 1;
+        input->closed = 1;
+        return 0;
+    }
+
+    *value = packed >> 2;
+    return 1;
+}
+
+// 不输出任何内容地重放一局游戏，并报告结束时的状态
+int play_replay(const char *path)
+{
+    size_t length;
+    unsigned char *buffer = load_file(path, &length);
+    if (buffer == NULL)
+    {
+        printf("%s: 无法读取\n", path);
+        return 0;
+    }
+
+    int status = check_header(buffer, length, "DQRP", REPLAY_VERSION);
+    if (status != SAVE_OK)
+    {
+        printf("%s: %s\n", path, save_status_text(status));
+        free(buffer);
+        return 0;
+    }
+
+    SaveReader reader = {buffer, length, SAVE_HEADER_SIZE, 0};
+    uint64_t seed = get_varint(&reader);
+    uint64_t start_length = get_varint(&reader);
+    if (reader.error || start_length > length - reader.pos)
+    {
+        printf("%s: %s\n", path, save_status_text(SAVE_CORRUPT));
+        free(buffer);
+        return 0;
+    }
+    const unsigned char *start = buffer + reader.pos;
+    reader.pos += start_length;
+
+    GameData game = {0};
+    Input input;
+    Output output = {NULL};
+
+    game.world = current_world;
+
+    input_from_replay(&input, buffer + reader.pos, length - reader.pos);
+    game.input = &input;
+    game.output = &output;
+
+    status = save_decode(&game, start, (size_t)start_length);
+    if (status != SAVE_OK)
+    {
+        printf("%s: %s\n", path, save_status_text(status));
+        free(buffer);
+        return 0;
+    }
+
+    rng_seed(&game.rng, seed);
+    main_menu(&game);
+    run_game(&game);
+
+    printf("%s: %s 等级%ld 生命值%ld/%ld 金币%ld %s%s", path, game.player.name, game.player.level,
+           game.player.hp, game.player.max_hp, game.player.gold,
+           text(game.world, game.world->locations[game.current_location].name),
+           game.dragon_defeated ? " 已击败恶龙" : "");
+
+    int ok = 1;
+    if (input.diverged)
+    {
+        printf(" [第%zu字节处与当前版本不一致]", input.replay.pos);
+        ok = 0;
+    }
+    else if (input.replay.pos < input.replay.size)
+    {
+        printf(" [游戏提前结束，剩余%zu字节输入]", input.replay.size - input.replay.pos);
+        ok = 0;
+    }
+    printf("\n");
+
+    free(buffer);
+    return ok;
+}
+
+int run_replays(int argc, char *argv[])
+{
+    clock_t begin = clock();
+    int bad = 0;
+
+    if (argc == 0)
+    {
+        printf("用法: --replay 回放文件...\n");
+        return 1;
+    }
+
+    for (int i = 0; i < argc; i++)
+    {
+        bad += !play_replay(argv[i]);
+    }
+
+    printf("共回放%d局，%d局与录制时不同，用时%.2f秒。\n", argc, bad,
+           (double)(clock() - begin) / CLOCKS_PER_SEC);
+    return bad ? 1 : 0;
+}
+
+// ========== 存档格式 ==========
+// 头部16字节: 魔数"DQSV" | 版本(2) | 保留(2) | 数据长度(4) | CRC32C(4)，均为小端序
+// 数据由若干条记录组成: 标签(1) | 长度(2) | 内容，读取时跳过不认识的标签
+// 数值都用变长整数保存，有符号数先做zigzag编码
+
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C, 0x26A1E7E8, 0xD4CA64EB,
+    0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B, 0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24,
+    0x105EC76F, 0xE235446C, 0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+    0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC, 0xBC267848, 0x4E4DFB4B,
+    0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A, 0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35,
+    0xAA64D611, 0x580F5512, 0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+    0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD, 0x1642AE59, 0xE4292D5A,
+    0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A, 0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595,
+    0x417B1DBC, 0xB3109EBF, 0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+    0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F, 0xED03A29B, 0x1F682198,
+    0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927, 0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38,
+    0xDBFC821C, 0x2997011F, 0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+    0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E, 0x4767748A, 0xB50CF789,
+    0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859, 0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46,
+    0x7198540D, 0x83F3D70E, 0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+    0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE, 0xDDE0EB2A, 0x2F8B6829,
+    0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C, 0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93,
+    0x082F63B7, 0xFA44E0B4, 0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+    0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B, 0xB4091BFF, 0x466298FC,
+    0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C, 0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033,
+    0xA24BB5A6, 0x502036A5, 0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+    0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975, 0x0E330A81, 0xFC588982,
+    0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D, 0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622,
+    0x38CC2A06, 0xCAA7A905, 0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+    0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8, 0xE52CC12C, 0x1747422F,
+    0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF, 0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0,
+    0xD3D3E1AB, 0x21B862A8, 0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+    0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78, 0x7FAB5E8C, 0x8DC0DD8F,
+    0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE, 0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1,
+    0x69E9F0D5, 0x9B8273D6, 0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+    0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69, 0xD5CF889D, 0x27A40B9E,
+    0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E, 0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
+};
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    crc = ~crc;
+    while (length--)
+    {
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void put_u8(SaveWriter *writer, unsigned value)
+{
+    if (writer->size >= writer->capacity)
+    {
+        writer->overflow = 1;
+        return;
+    }
+    writer->data[writer->size++] = (unsigned char)value;
+}
+
+void put_u16(SaveWriter *writer, unsigned value)
+{
+    put_u8(writer, value & 0xFF);
+    put_u8(writer, (value >> 8) & 0xFF);
+}
+
+void put_u32(SaveWriter *writer, uint32_t value)
+{
+    put_u16(writer, value & 0xFFFF);
+    put_u16(writer, value >> 16);
+}
+
+void put_varint(SaveWriter *writer, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        put_u8(writer, (unsigned)(value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    put_u8(writer, (unsigned)value);
+}
+
+void put_svarint(SaveWriter *writer, int64_t value)
+{
+    put_varint(writer, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void put_bytes(SaveWriter *writer, const void *data, size_t length)
+{
+    if (writer->size + length > writer->capacity)
+    {
+        writer->overflow = 1;
+        return;
+    }
+    if (length > 0)
+    {
+        memcpy(writer->data + writer->size, data, length);
+    }
+    writer->size += length;
+}
+
+void put_string(SaveWriter *writer, const char *text)
+{
+    size_t length = strlen(text);
+    put_varint(writer, length);
+    put_bytes(writer, text, length);
+}
+
+// 开始一条记录，返回长度字段的位置，结束时由end_record回填
+size_t begin_record(SaveWriter *writer, int tag)
+{
+    put_u8(writer, tag);
+    put_u16(writer, 0);
+    return writer->size;
+}
+
+// 记录长度固定用2字节保存，回填时不需要移动数据
+void end_record(SaveWriter *writer, size_t start)
+{
+    size_t length = writer->size - start;
+    if (writer->overflow || length > 0xFFFF)
+    {
+        writer->overflow = 1;
+        return;
+    }
+    writer->data[start - 2] = length & 0xFF;
+    writer->data[start - 1] = (length >> 8) & 0xFF;
+}
+
+unsigned get_u8(SaveReader *reader)
+{
+    if (reader->pos >= reader->size)
+    {
+        reader->error = 1;
+        return 0;
+    }
+    return reader->data[reader->pos++];
+}
+
+unsigned get_u16(SaveReader *reader)
+{
+    unsigned low = get_u8(reader);
+    return low | (get_u8(reader) << 8);
+}
+
+uint32_t get_u32(SaveReader *reader)
+{
+    uint32_t low = get_u16(reader);
+    return low | ((uint32_t)get_u16(reader) << 16);
+}
+
+uint64_t get_varint(SaveReader *reader)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        unsigned byte = get_u8(reader);
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    reader->error = 1;
+    return 0;
+}
+
+int64_t get_svarint(SaveReader *reader)
+{
+    uint64_t value = get_varint(reader);
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// 读取字符串，超过size-1字节视为损坏
+void get_string(SaveReader *reader, char *text, size_t size)
+{
+    uint64_t length = get_varint(reader);
+    if (length >= size || length > reader->size - reader->pos)
+    {
+        reader->error = 1;
+        text[0] = '\0';
+        return;
+    }
+    memcpy(text, reader->data + reader->pos, length);
+    text[length] = '\0';
+    reader->pos += length;
+}
+
+// 把存档编码到buffer中，返回字节数，空间不足时返回0
+size_t save_encode(const GameData *game, unsigned char *buffer, size_t capacity)
+{
+    SaveWriter writer = {buffer, capacity, SAVE_HEADER_SIZE, 0};
+    const Player *player = &game->player;
+    size_t record;
+
+    if (capacity < SAVE_HEADER_SIZE)
+        return 0;
+
+    record = begin_record(&writer, SAVE_TAG_PLAYER);
+    put_string(&writer, player->name);
+    put_svarint(&writer, player->hp);
+    put_svarint(&writer, player->max_hp);
+    put_svarint(&writer, player->mp);
+    put_svarint(&writer, player->max_mp);
+    put_svarint(&writer, player->exp);
+    put_svarint(&writer, player->level);
+    put_svarint(&writer, player->gold);
+    put_svarint(&writer, player->attack);
+    put_svarint(&writer, player->defense);
+    put_svarint(&writer, player->agility);
+    put_svarint(&writer, player->intelligence);
+    end_record(&writer, record);
+
+    record = begin_record(&writer, SAVE_TAG_STACKS);
+    put_varint(&writer, game->inventory_count);
+    for (int i = 0; i < game->inventory_count; i++)
+    {
+        const ItemStack *stack = &game->inventory[i];
+        put_string(&writer, text(game->world, game->world->items[stack->item].name));
+        put_varint(&writer, stack->count);
+    }
+    end_record(&writer, record);
+
+    int skills[MAX_SKILLS];
+    int skill_count = skill_set_list(&game->learned_skills, skills);
+    record = begin_record(&writer, SAVE_TAG_SKILLS);
+    put_varint(&writer, skill_count);
+    for (int i = 0; i < skill_count; i++)
+    {
+        put_varint(&writer, skills[i]);
+    }
+    end_record(&writer, record);
+
+    record = begin_record(&writer, SAVE_TAG_PROGRESS);
+    put_varint(&writer, game->current_location);
+    put_varint(&writer, game->dragon_defeated);
+    end_record(&writer, record);
+
+    if (writer.overflow)
+        return 0;
+
+    return finish_header(&writer, "DQSV", SAVE_VERSION);
+}
+
+// 回填头部，返回文件总长度
+size_t finish_header(SaveWriter *writer, const char *magic, unsigned version)
+{
+    unsigned char *payload = writer->data + SAVE_HEADER_SIZE;
+    size_t length = writer->size - SAVE_HEADER_SIZE;
+
+    writer->size = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        put_u8(writer, (unsigned char)magic[i]);
+    }
+    put_u16(writer, version);
+    put_u16(writer, 0);
+    put_u32(writer, (uint32_t)length);
+    put_u32(writer, crc32c(0, payload, length));
+
+    return SAVE_HEADER_SIZE + length;
+}
+
+// 只检查头部和校验和，不解析内容
+int check_header(const unsigned char *buffer, size_t length, const char *magic, unsigned max_version)
+{
+    SaveReader reader = {buffer, length, 0, 0};
+
+    if (length < SAVE_HEADER_SIZE)
+        return SAVE_TRUNCATED;
+    if (memcmp(buffer, magic, 4) != 0)
+        return SAVE_BAD_MAGIC;
+
+    reader.pos = 4;
+    unsigned version = get_u16(&reader);
+    get_u16(&reader);
+    uint32_t payload = get_u32(&reader);
+    uint32_t crc = get_u32(&reader);
+
+    if (version == 0 || version > max_version)
+        return SAVE_BAD_VERSION;
+    if (payload != length - SAVE_HEADER_SIZE)
+        return SAVE_TRUNCATED;
+    if (crc32c(0, buffer + SAVE_HEADER_SIZE, payload) != crc)
+        return SAVE_BAD_CHECKSUM;
+
+    return SAVE_OK;
+}
+
+int save_validate(const unsigned char *buffer, size_t length)
+{
+    return check_header(buffer, length, "DQSV", SAVE_VERSION);
+}
+
+const char *save_status_text(int status)
+{
+    switch (status)
+    {
+    case SAVE_OK:
+        return "正常";
+    case SAVE_TRUNCATED:
+        return "文件不完整";
+    case SAVE_BAD_MAGIC:
+        return "不是存档文件";
+    case SAVE_BAD_VERSION:
+        return "不支持的存档版本";
+    case SAVE_BAD_CHECKSUM:
+        return "校验和错误";
+    case SAVE_NOT_FOUND:
+        return "存档不存在";
+    default:
+        return "存档内容损坏";
+    }
+}
+
+// 解码存档，旧版本的记录在这里转换为当前格式
+int save_decode(GameData *game, const unsigned char *buffer, size_t length)
+{
+    int status = save_validate(buffer, length);
+    if (status != SAVE_OK)
+        return status;
+
+    // 每种记录只出现在特定版本中，比当前更新的版本无法读取
+    unsigned version = buffer[4] | (buffer[5] << 8);
+    if (version > SAVE_VERSION)
+        return SAVE_BAD_VERSION;
+
+    SaveReader reader = {buffer, length, SAVE_HEADER_SIZE, 0};
+    GameData loaded;
+    int has_player = 0;
+
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.world = game->world; // 物品按名称换成这个世界中的编号
+
+    while (reader.pos < reader.size && !reader.error)
+    {
+        int tag = get_u8(&reader);
+        size_t record_length = get_u16(&reader);
+        if (reader.error || record_length > reader.size - reader.pos)
+            return SAVE_CORRUPT;
+
+        SaveReader record = {reader.data + reader.pos, record_length, 0, 0};
+        reader.pos += record_length;
+
+        switch (tag)
+        {
+        case SAVE_TAG_PLAYER:
+        {
+            Player *player = &loaded.player;
+            get_string(&record, player->name, sizeof(player->name));
+            player->hp = get_svarint(&record);
+            player->max_hp = get_svarint(&record);
+            player->mp = get_svarint(&record);
+            player->max_mp = get_svarint(&record);
+            player->exp = get_svarint(&record);
+            player->level = get_svarint(&record);
+            player->gold = get_svarint(&record);
+            player->attack = get_svarint(&record);
+            player->defense = get_svarint(&record);
+            player->agility = get_svarint(&record);
+            player->intelligence = get_svarint(&record);
+            has_player = 1;
+            break;
+        }
+        case SAVE_TAG_INVENTORY:
+        {
+            // 第1版每件物品单独保存，按名称换成物品编号后叠放，数值以世界数据为准
+            uint64_t count = get_varint(&record);
+            if (version != 1 || count > MAX_INVENTORY)
+                return SAVE_CORRUPT;
+            for (uint64_t i = 0; i < count; i++)
+            {
+                char name[MAX_NAME_LENGTH];
+                get_string(&record, name, sizeof(name));
+                get_varint(&record);  // 类型
+                get_svarint(&record); // 数值
+                get_svarint(&record); // 价格
+
+                int item = find_item(loaded.world, string_find(loaded.world, name));
+                if (item < 0 || !add_item(&loaded, item, 1))
+                    return SAVE_CORRUPT;
+            }
+            break;
+        }
+        case SAVE_TAG_STACKS:
+        {
+            uint64_t count = get_varint(&record);
+            if (version < 2 || count > MAX_INVENTORY)
+                return SAVE_CORRUPT;
+            for (uint64_t i = 0; i < count; i++)
+            {
+                char name[MAX_NAME_LENGTH];
+                get_string(&record, name, sizeof(name));
+                uint64_t amount = get_varint(&record);
+
+                int item = find_item(loaded.world, string_find(loaded.world, name));
+                if (item < 0 || amount == 0 || amount > MAX_STACK_COUNT || !add_item(&loaded, item, (int)amount))
+                    return SAVE_CORRUPT;
+            }
+            break;
+        }
+        case SAVE_TAG_SKILLS:
+        {
+            uint64_t count = get_varint(&record);
+            if (count > MAX_SKILLS)
+                return SAVE_CORRUPT;
+            for (uint64_t i = 0; i < count; i++)
+            {
+                uint64_t skill = get_varint(&record);
+                if (skill >= MAX_SKILLS)
+                    return SAVE_CORRUPT;
+                skill_set_add(&loaded.learned_skills, (int)skill);
+            }
+            break;
+        }
+        case SAVE_TAG_PROGRESS:
+        {
+            uint64_t location = get_varint(&record);
+            if (location >= MAX_LOCATIONS)
+                return SAVE_CORRUPT;
+            loaded.current_location = (int)location;
+            loaded.dragon_defeated = get_varint(&record) != 0;
+            break;
+        }
+        default:
+            return SAVE_CORRUPT;
+        }
+
+        if (record.error)
+            return SAVE_CORRUPT;
+    }
+
+    if (reader.error || !has_player)
+        return SAVE_CORRUPT;
+
+    loaded.rng = game->rng;
+    loaded.input = game->input;
+    loaded.output = game->output;
+    loaded.menu = game->menu;
+    *game = loaded;
+    return SAVE_OK;
+}
+
+// 读取整个文件，返回字节数，失败返回-1
+long read_file(const char *filename, unsigned char *buffer, size_t capacity)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+        return -1;
+
+    size_t length = fread(buffer, 1, capacity, file);
+    fclose(file);
+    return (long)length;
+}
+
+// 读入整个文件，返回新分配的缓冲区
+unsigned char *load_file(const char *filename, size_t *length)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char *buffer = size >= 0 ? malloc(size > 0 ? size : 1) : NULL;
+    if (buffer && fread(buffer, 1, size, file) != (size_t)size)
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+
+    *length = (size_t)size;
+    return buffer;
+}
+
+// 批量检查存档文件，用法: Dragon_Quest --verify-saves 文件...
+int verify_save_file(const char *path, unsigned char *buffer, size_t capacity)
+{
+    long length = read_file(path, buffer, capacity);
+    if (length < 0)
+    {
+        printf("%s: 无法读取\n", path);
+        return 0;
+    }
+
+    int status = save_validate(buffer, (size_t)length);
+    if (status != SAVE_OK)
+    {
+        printf("%s: %s\n", path, save_status_text(status));
+        return 0;
+    }
+    return 1;
+}
+
+// 批量检查存档文件，不指定文件时检查存档目录中的所有栏位
+int verify_saves(int argc, char *argv[])
+{
+    unsigned char buffer[SAVE_MAX_SIZE + 1];
+    int total = 0;
+    int bad = 0;
+
+    if (argc > 0)
+    {
+        for (int i = 0; i < argc; i++)
+        {
+            bad += !verify_save_file(argv[i], buffer, sizeof(buffer));
+        }
+        total = argc;
+    }
+    else
+    {
+        bad = verify_save_store(buffer, sizeof(buffer), &total);
+    }
+
+    printf("共检查%d个存档，%d个正常，%d个损坏。\n", total, total - bad, bad);
+    return bad ? 1 : 0;
+}
+
+// ========== 后台存档 ==========
+// 存档先写入临时文件并刷到磁盘，再原子地替换原文件，写到一半崩溃也不会损坏旧存档。
+// 写入由后台线程完成，同一文件还没写入的存档会被新的存档直接覆盖。
+
+SaveQueue save_queue = {MUTEX_INITIALIZER, COND_INITIALIZER, COND_INITIALIZER};
+
+int write_file_atomic(const char *path, const unsigned char *data, size_t length)
+{
+    char temp_path[SAVE_PATH_LENGTH + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+#ifdef _WIN32
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL)
+        return 0;
+
+    int ok = fwrite(data, 1, length, file) == length && fflush(file) == 0 && _commit(_fileno(file)) == 0;
+    fclose(file);
+    if (!ok || !MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        remove(temp_path);
+        return 0;
+    }
+    return 1;
+#else
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        written += (size_t)n;
+    }
+
+    int ok = written == length && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp_path, path) != 0)
+    {
+        unlink(temp_path);
+        return 0;
+    }
+
+    // 目录也要刷到磁盘，重命名才算真正完成
+    char dir[SAVE_PATH_LENGTH];
+    const char *slash = strrchr(path, '/');
+    if (slash)
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    else
+        strcpy(dir, ".");
+
+    int dir_fd = open(slash == path ? "/" : dir, O_RDONLY);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 1;
+#endif
+}
+
+THREAD_FUNC(save_worker)
+{
+    SaveQueue *queue = (SaveQueue *)arg;
+
+    mutex_lock(&queue->lock);
+    while (1)
+    {
+        while (queue->head == NULL && !queue->stop)
+        {
+            cond_wait(&queue->wake, &queue->lock);
+        }
+        if (queue->head == NULL)
+            break;
+
+        SaveJob *job = queue->head;
+        queue->head = job->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+        queue->writing = job;
+        mutex_unlock(&queue->lock);
+
+        if (!write_file_atomic(job->path, job->data, job->length))
+        {
+            fprintf(stderr, "存档写入失败：%s\n", job->path);
+        }
+
+        mutex_lock(&queue->lock);
+        queue->writing = NULL;
+        free(job->data);
+        free(job);
+        if (queue->head == NULL)
+            cond_broadcast(&queue->idle);
+    }
+    mutex_unlock(&queue->lock);
+
+    THREAD_RETURN;
+}
+
+// 把存档交给后台线程写入，立即返回
+int save_queue_push(const char *path, const unsigned char *data, size_t length)
+{
+    SaveQueue *queue = &save_queue;
+    SaveJob *job = NULL;
+
+    if (strlen(path) >= SAVE_PATH_LENGTH)
+        return 0;
+
+    unsigned char *copy = malloc(length);
+    if (copy == NULL)
+        return 0;
+    memcpy(copy, data, length);
+
+    mutex_lock(&queue->lock);
+
+    if (!queue->started)
+    {
+        if (!thread_start(&queue->thread, save_worker, queue))
+        {
+            mutex_unlock(&queue->lock);
+            int ok = write_file_atomic(path, copy, length);
+            free(copy);
+            return ok;
+        }
+        queue->started = 1;
+        queue->stop = 0;
+        atexit(save_queue_shutdown);
+    }
+
+    // 同一文件还没写入的旧数据直接丢弃，新数据排到队尾，保证写入顺序与保存顺序一致
+    for (SaveJob *prev = NULL, *pending = queue->head; pending; prev = pending, pending = pending->next)
+    {
+        if (strcmp(pending->path, path) == 0)
+        {
+            if (prev)
+                prev->next = pending->next;
+            else
+                queue->head = pending->next;
+            if (queue->tail == pending)
+                queue->tail = prev;
+            free(pending->data);
+            job = pending;
+            break;
+        }
+    }
+
+    if (job == NULL)
+    {
+        job = malloc(sizeof(SaveJob));
+        if (job == NULL)
+        {
+            mutex_unlock(&queue->lock);
+            free(copy);
+            return 0;
+        }
+        strcpy(job->path, path);
+    }
+    job->data = copy;
+    job->length = length;
+    job->next = NULL;
+
+    if (queue->tail)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+
+    cond_signal(&queue->wake);
+    mutex_unlock(&queue->lock);
+    return 1;
+}
+
+// 读取还没写入磁盘的存档，返回长度；队列中没有这个文件时返回-1，调用者再读文件
+long save_queue_read(const char *path, unsigned char *buffer, size_t capacity)
+{
+    SaveQueue *queue = &save_queue;
+    const SaveJob *job = NULL;
+    long length = -1;
+
+    mutex_lock(&queue->lock);
+    // 同一文件在队列中最多一个，比正在写入的更新
+    for (const SaveJob *pending = queue->head; pending && job == NULL; pending = pending->next)
+    {
+        if (strcmp(pending->path, path) == 0)
+            job = pending;
+    }
+    if (job == NULL && queue->writing && strcmp(queue->writing->path, path) == 0)
+        job = queue->writing;
+    if (job && job->length <= capacity)
+    {
+        memcpy(buffer, job->data, job->length);
+        length = (long)job->length;
+    }
+    mutex_unlock(&queue->lock);
+    return length;
+}
+
+// 等待所有存档写入磁盘
+void save_queue_flush(void)
+{
+    SaveQueue *queue = &save_queue;
+
+    mutex_lock(&queue->lock);
+    while (queue->head || queue->writing)
+    {
+        cond_wait(&queue->idle, &queue->lock);
+    }
+    mutex_unlock(&queue->lock);
+}
+
+// 退出前写完剩余的存档
+void save_queue_shutdown(void)
+{
+    SaveQueue *queue = &save_queue;
+
+    mutex_lock(&queue->lock);
+    if (!queue->started)
+    {
+        mutex_unlock(&queue->lock);
+        return;
+    }
+    queue->stop = 1;
+    queue->started = 0;
+    cond_signal(&queue->wake);
+    mutex_unlock(&queue->lock);
+
+    thread_join(queue->thread);
+}
+
+// ========== 多栏位存档 ==========
+// 存档按(角色名, 栏位)保存在SAVE_DIR目录下，文件名是索引分配的编号。
+// 索引文件记录所有栏位，启动时读入一次并建立哈希表，查找和列出栏位都不需要扫描目录。
+// 索引格式与存档相同的头部(魔数"DQIX")，内容为: 下一个文件编号 | 栏位数 | 每个栏位的信息
+
+SaveStore save_store = {MUTEX_INITIALIZER};
+
+uint32_t slot_hash(const char *player, int slot)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)player; *p; p++)
+    {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return (hash ^ (uint32_t)slot) * 16777619u;
+}
+
+// 返回栏位在哈希表中的位置，不存在时返回空位置
+int slot_probe(SaveStore *store, const char *player, int slot)
+{
+    int mask = store->table_size - 1;
+    int pos = (int)(slot_hash(player, slot) & (uint32_t)mask);
+
+    while (store->table[pos])
+    {
+        SaveSlot *entry = &store->slots[store->table[pos] - 1];
+        if (entry->slot == slot && strcmp(entry->player, player) == 0)
+            break;
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+void rebuild_slot_table(SaveStore *store, int table_size)
+{
+    free(store->table);
+    store->table = calloc(table_size, sizeof(int));
+    store->table_size = table_size;
+    for (int i = 0; i < store->count; i++)
+    {
+        int pos = slot_probe(store, store->slots[i].player, store->slots[i].slot);
+        store->table[pos] = i + 1;
+    }
+}
+
+// 查找栏位，不存在时创建
+SaveSlot *add_slot(SaveStore *store, const char *player, int slot)
+{
+    if ((store->count + 1) * 2 > store->table_size)
+    {
+        rebuild_slot_table(store, store->table_size ? store->table_size * 2 : 64);
+    }
+
+    int pos = slot_probe(store, player, slot);
+    if (store->table[pos])
+        return &store->slots[store->table[pos] - 1];
+
+    if (store->count == store->capacity)
+    {
+        store->capacity = store->capacity ? store->capacity * 2 : 32;
+        store->slots = realloc(store->slots, sizeof(SaveSlot) * store->capacity);
+    }
+
+    SaveSlot *entry = &store->slots[store->count];
+    memset(entry, 0, sizeof(SaveSlot));
+    snprintf(entry->player, sizeof(entry->player), "%s", player);
+    entry->slot = slot;
+    entry->file_id = store->next_file_id++;
+    store->table[pos] = ++store->count;
+    return entry;
+}
+
+void slot_path(const SaveSlot *entry, const char *extension, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%08" PRIX32 ".%s", SAVE_DIR, entry->file_id, extension);
+}
+
+// 把索引编码到新分配的缓冲区中
+unsigned char *encode_slot_index(SaveStore *store, size_t *length)
+{
+    size_t capacity = SAVE_HEADER_SIZE + 16 + (size_t)store->count * (MAX_NAME_LENGTH + 48);
+    unsigned char *buffer = malloc(capacity);
+    SaveWriter writer = {buffer, capacity, SAVE_HEADER_SIZE, 0};
+
+    put_varint(&writer, store->next_file_id);
+    put_varint(&writer, store->count);
+    for (int i = 0; i < store->count; i++)
+    {
+        SaveSlot *entry = &store->slots[i];
+        put_string(&writer, entry->player);
+        put_varint(&writer, entry->slot);
+        put_varint(&writer, entry->file_id);
+        put_varint(&writer, entry->level);
+        put_varint(&writer, entry->location);
+        put_svarint(&writer, entry->saved_at);
+    }
+
+    *length = finish_header(&writer, "DQIX", SAVE_INDEX_VERSION);
+    return buffer;
+}
+
+int decode_slot_index(SaveStore *store, const unsigned char *buffer, size_t length)
+{
+    if (check_header(buffer, length, "DQIX", SAVE_INDEX_VERSION) != SAVE_OK)
+        return 0;
+
+    SaveReader reader = {buffer, length, SAVE_HEADER_SIZE, 0};
+    uint32_t next_file_id = (uint32_t)get_varint(&reader);
+    uint64_t count = get_varint(&reader);
+
+    for (uint64_t i = 0; i < count && !reader.error; i++)
+    {
+        char player[MAX_NAME_LENGTH];
+        get_string(&reader, player, sizeof(player));
+        int slot = (int)get_varint(&reader);
+        uint32_t file_id = (uint32_t)get_varint(&reader);
+        int level = (int)get_varint(&reader);
+        int location = (int)get_varint(&reader);
+        int64_t saved_at = get_svarint(&reader);
+        if (reader.error)
+            break;
+
+        SaveSlot *entry = add_slot(store, player, slot);
+        entry->file_id = file_id;
+        entry->level = level;
+        entry->location = location;
+        entry->saved_at = saved_at;
+    }
+
+    store->next_file_id = next_file_id;
+    return !reader.error;
+}
+
+// 后台写入索引文件
+// 存档目录的错误显示给触发它的玩家，没有对局时(--verify-saves)直接输出
+void report_store_error(GameData *game, const char *message)
+{
+    if (game)
+    {
+        print(game, "%s\n", message);
+    }
+    else
+    {
+        printf("%s\n", message);
+    }
+}
+
+void write_slot_index(SaveStore *store, GameData *game)
+{
+    size_t length;
+    unsigned char *buffer = encode_slot_index(store, &length);
+    char path[SAVE_PATH_LENGTH];
+
+    snprintf(path, sizeof(path), "%s/%s", SAVE_DIR, SAVE_INDEX_FILE);
+    if (!save_queue_push(path, buffer, length))
+    {
+        report_store_error(game, "无法写入存档索引！");
+    }
+    free(buffer);
+}
+
+// 转换最初版本原样写入的存档，文件大小不符或内容不合理时返回0
+int convert_legacy_save(GameData *game, const unsigned char *data, size_t length)
+{
+    LegacyGameData old;
+
+    if (length != sizeof(old))
+        return 0;
+    memcpy(&old, data, sizeof(old));
+
+    if (memchr(old.player.name, '\0', sizeof(old.player.name)) == NULL || old.player.name[0] == '\0' ||
+        old.player.level < 1 || old.inventory_count < 0 || old.inventory_count > 30 ||
+        old.learned_skill_count < 0 || old.learned_skill_count > 20 ||
+        old.current_location < 0 || old.current_location >= MAX_LOCATIONS)
+        return 0;
+
+    game->player = old.player;
+    game->current_location = old.current_location;
+    game->dragon_defeated = old.dragon_defeated != 0;
+
+    // 物品按名称换成编号，数值以世界数据为准，已经不存在的物品丢弃
+    for (int i = 0; i < old.inventory_count; i++)
+    {
+        old.inventory[i].name[sizeof(old.inventory[i].name) - 1] = '\0';
+        int item = find_item(game->world, string_find(game->world, old.inventory[i].name));
+        if (item >= 0)
+        {
+            add_item(game, item, 1);
+        }
+    }
+    for (int i = 0; i < old.learned_skill_count; i++)
+    {
+        if (old.learned_skills[i] >= 0 && old.learned_skills[i] < MAX_SKILLS)
+        {
+            skill_set_add(&game->learned_skills, old.learned_skills[i]);
+        }
+    }
+    return 1;
+}
+
+// 旧版本只有一个存档文件，没有索引时把它导入为该角色的第1个栏位。
+// 现在格式的存档直接使用，最初版本的存档先转换
+void import_legacy_save(SaveStore *store, GameData *game)
+{
+    unsigned char save[SAVE_MAX_SIZE];
+    char path[SAVE_PATH_LENGTH];
+    GameData legacy;
+
+    unsigned char *data = malloc(sizeof(LegacyGameData) + 1);
+    if (data == NULL)
+        return;
+    long length = read_file(SAVE_FILE, data, sizeof(LegacyGameData) + 1);
+    if (length < 0)
+    {
+        free(data);
+        return;
+    }
+
+    memset(&legacy, 0, sizeof(legacy));
+    legacy.world = game ? game->world : current_world;
+    if ((size_t)length <= sizeof(save) && save_decode(&legacy, data, (size_t)length) == SAVE_OK)
+    {
+        memcpy(save, data, (size_t)length);
+    }
+    else if (convert_legacy_save(&legacy, data, (size_t)length))
+    {
+        length = (long)save_encode(&legacy, save, sizeof(save));
+    }
+    else
+    {
+        length = 0;
+    }
+    free(data);
+
+    if (length == 0)
+    {
+        report_store_error(game, "旧版本的存档" SAVE_FILE "无法读取，已忽略。");
+        return;
+    }
+
+    SaveSlot *entry = add_slot(store, legacy.player.name, 1);
+    entry->level = (int)legacy.player.level;
+    entry->location = legacy.current_location;
+    entry->saved_at = (int64_t)time(NULL);
+    slot_path(entry, "sav", path, sizeof(path));
+
+    if (save_queue_push(path, save, (size_t)length))
+    {
+        write_slot_index(store, game);
+    }
+}
+
+// 第一次使用时读入索引，调用者需持有锁
+void open_save_store(SaveStore *store, GameData *game)
+{
+    if (store->opened)
+        return;
+    store->opened = 1;
+    store->next_file_id = 1;
+
+#ifdef _WIN32
+    _mkdir(SAVE_DIR);
+#else
+    mkdir(SAVE_DIR, 0755);
+#endif
+
+    char path[SAVE_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", SAVE_DIR, SAVE_INDEX_FILE);
+
+    size_t length;
+    unsigned char *buffer = load_file(path, &length);
+    if (buffer == NULL)
+    {
+        import_legacy_save(store, game);
+        return;
+    }
+
+    if (!decode_slot_index(store, buffer, length))
+    {
+        report_store_error(game, "存档索引已损坏！");
+    }
+    free(buffer);
+}
+
+// 查找栏位，结果复制到entry中
+int find_save_slot(GameData *game, const char *player, int slot, SaveSlot *entry)
+{
+    SaveStore *store = &save_store;
+    int found = 0;
+
+    mutex_lock(&store->lock);
+    open_save_store(store, game);
+    if (store->count > 0)
+    {
+        int pos = slot_probe(store, player, slot);
+        if (store->table[pos])
+        {
+            *entry = store->slots[store->table[pos] - 1];
+            found = 1;
+        }
+    }
+    mutex_unlock(&store->lock);
+    return found;
+}
+
+// 保存到指定栏位，存档和索引都交给后台线程写入
+int save_to_slot(GameData *game, int slot)
+{
+    SaveStore *store = &save_store;
+    unsigned char buffer[SAVE_MAX_SIZE];
+    char path[SAVE_PATH_LENGTH];
+
+    size_t length = save_encode(game, buffer, sizeof(buffer));
+    if (length == 0)
+        return 0;
+
+    mutex_lock(&store->lock);
+    open_save_store(store, game);
+
+    SaveSlot *entry = add_slot(store, game->player.name, slot);
+    entry->level = (int)game->player.level;
+    entry->location = game->current_location;
+    entry->saved_at = (int64_t)time(NULL);
+    slot_path(entry, "sav", path, sizeof(path));
+
+    int ok = save_queue_push(path, buffer, length);
+    if (ok)
+    {
+        // 同时保存这局游戏到目前为止的回放，方便重现问题
+        if (game->input->record)
+        {
+            slot_path(entry, "rpl", path, sizeof(path));
+            write_replay(game->input->record, path);
+        }
+        write_slot_index(store, game);
+    }
+    mutex_unlock(&store->lock);
+    return ok;
+}
+
+int load_from_slot(GameData *game, const char *player, int slot)
+{
+    SaveSlot entry;
+    unsigned char buffer[SAVE_MAX_SIZE + 1];
+    char path[SAVE_PATH_LENGTH];
+
+    if (!find_save_slot(game, player, slot, &entry))
+        return SAVE_NOT_FOUND;
+
+    // 刚保存的存档可能还在后台队列中，只查这一个文件，不等待其他存档写完
+    slot_path(&entry, "sav", path, sizeof(path));
+    long length = save_queue_read(path, buffer, sizeof(buffer));
+    if (length < 0)
+        length = read_file(path, buffer, sizeof(buffer));
+    if (length < 0)
+        return SAVE_NOT_FOUND;
+
+    return save_decode(game, buffer, (size_t)length);
+}
+
+// 检查所有栏位的存档文件，返回损坏的个数
+int verify_save_store(unsigned char *buffer, size_t capacity, int *total)
+{
+    SaveStore *store = &save_store;
+    char path[SAVE_PATH_LENGTH];
+    int bad = 0;
+
+    mutex_lock(&store->lock);
+    open_save_store(store, NULL);
+    save_queue_flush();
+    for (int i = 0; i < store->count; i++)
+    {
+        slot_path(&store->slots[i], "sav", path, sizeof(path));
+        bad += !verify_save_file(path, buffer, capacity);
+    }
+    *total = store->count;
+    mutex_unlock(&store->lock);
+    return bad;
+}
+
+// 显示角色的栏位，返回已有存档的栏位数
+int show_save_slots(GameData *game, const char *player, int show_empty)
+{
+    int used = 0;
+    SaveSlot entry;
+
+    for (int slot = 1; slot <= SAVE_SLOTS; slot++)
+    {
+        if (find_save_slot(game, player, slot, &entry))
+        {
+            char saved_at[32];
+            time_t t = (time_t)entry.saved_at;
+            struct tm local; // 多个工作线程同时显示，不能用localtime的共享缓冲区
+#ifdef _WIN32
+            localtime_s(&local, &t);
+#else
+            localtime_r(&t, &local);
+#endif
+            strftime(saved_at, sizeof(saved_at), "%Y-%m-%d %H:%M", &local);
+            print(game, "%d. 等级%d %s (%s)\n", slot, entry.level,
+                   text(game->world, game->world->locations[entry.location % MAX_LOCATIONS].name), saved_at);
+            used++;
+        }
+        else if (show_empty)
+        {
+            print(game, "%d. (空)\n", slot);
+        }
+    }
+    return used;
+}
+
+// 列出还没学会且等级足够的技能，返回个数
+int learnable_skills(GameData *game, int *skills)
+{
+    SkillSet learnable = skills_for_level(game->world, game->player.level);
+
+    // 等级满足要求且还没学会
+    for (int i = 0; i < SKILL_WORDS; i++)
+    {
+        learnable.bits[i] &= ~game->learned_skills.bits[i];
+    }
+    return skill_set_list(&learnable, skills);
+}
+
+// 学习新技能
+void learn_skills(GameData *game)
+{
+    print(game, "\n========== 可学习的技能 ==========\n");
+    int available_skill_indices[MAX_SKILLS];
+    int available_skills = learnable_skills(game, available_skill_indices);
+
+    for (int i = 0; i < available_skills; i++)
+    {
+        const Skill *skill = &game->world->skills[available_skill_indices[i]];
+
+        print(game, "%d. %s (需要等级: %d)", i + 1, text(game->world, skill->name), skill->required_level);
+
+        if (skill->damage > 0)
+        {
+            print(game, " - 造成%d点伤害", skill->damage);
+        }
+        if (skill->heal > 0)
+        {
+            print(game, " - 恢复%d点生命", skill->heal);
+        }
+        print(game, "\n");
+    }
+
+    if (available_skills == 0)
+    {
+        print(game, "当前没有可学习的新技能。\n");
+        return;
+    }
+
+    print(game, "请选择要学习的技能 (0返回): ");
+    game->menu.id = MENU_LEARN;
+}
+
+void learn_skills_input(GameData *game, int choice)
+{
+    int available_skill_indices[MAX_SKILLS];
+    int available_skills = learnable_skills(game, available_skill_indices);
+
+    if (choice == 0)
+        return;
+
+    if (choice > 0 && choice <= available_skills)
+    {
+        int skill_index = available_skill_indices[choice - 1];
+
+        skill_set_add(&game->learned_skills, skill_index);
+        print(game, "你学会了新技能：%s！\n", text(game->world, game->world->skills[skill_index].name));
+    }
+    else
+    {
+        print(game, "无效的选择。\n");
+    }
+}
+
+static const FrameSpan cheat_frame[] = {
+    FRAME_SPAN("========== 作弊列表 ==========\n"
+               "1. 添加2000点经验\n"
+               "2. 添加2000点金币\n"
+               "3. 添加100点生命值\n"
+               "4. 添加100点魔法值\n"
+               "5. 添加100点攻击力\n"
+               "6. 添加100点防御力\n"
+               "7. 添加100点敏捷\n"
+               "8. 添加100点智力\n"
+               "请选择要使用的作弊 (0返回): ",
+               FIELD_NONE)};
+
+void cheat_game(GameData *game)
+{
+    print_frame(game, FRAME_SPANS(cheat_frame));
+    game->menu.id = MENU_CHEAT;
+}
+
+void cheat_game_input(GameData *game, int cheat_choice)
+{
+    switch (cheat_choice)
+    {
+    case 1:
+        game->player.exp += 2000;
+        print(game, "已添加2000点经验！\n");
+        if (game->player.exp >= game->player.level * 100)
+        {
+            level_up(game);
+        }
+        break;
+    case 2:
+        game->player.gold += 2000;
+        print(game, "已添加2000点金币！\n");
+        break;
+    case 3:
+        game->player.max_hp += 100;
+        print(game, "已添加100点生命值！\n");
+        break;
+    case 4:
+        game->player.max_mp += 100;
+        print(game, "已添加100点魔法值！\n");
+        break;
+    case 5:
+        game->player.attack += 100;
+        print(game, "已添加100点攻击力！\n");
+        break;
+    case 6:
+        game->player.defense += 100;
+        print(game, "已添加100点防御力！\n");
+        break;
+    case 7:
+        game->player.agility += 100;
+        print(game, "已添加100点敏捷！\n");
+        break;
+    case 8:
+        game->player.intelligence += 100;
+        print(game, "已添加100点智力！\n");
+        break;
+    case 0:
+        break;
+    default:
+        print(game, "无效的选择。\n");
+    }
+}
+
+// ========== 内容包 ==========
+// 世界数据可以放在内容包中，不需要重新编译程序就能修改数值和文字。
+// --export-content 源文件 导出内置世界作为编辑的起点，--compile-content 源文件 内容包 编译，
+// --content 内容包 使用。内容包只读映射到内存后原样使用，多个进程共享同一份物理内存。
+
+static const ContentSectionDef content_sections[CONTENT_SECTIONS] = {
+    [SECTION_SKILL] = {"skill", offsetof(WorldDef, skills), sizeof(SkillDef), MAX_SKILLS},
+    [SECTION_LOCATION] = {"location", offsetof(WorldDef, locations), sizeof(LocationDef), MAX_LOCATIONS},
+    [SECTION_ENEMY] = {"enemy", offsetof(WorldDef, enemies), sizeof(EnemyDef), MAX_ENEMIES},
+    [SECTION_NPC] = {"npc", offsetof(WorldDef, npcs), sizeof(NpcDef), MAX_NPCS},
+    [SECTION_ITEM] = {"item", offsetof(WorldDef, items), sizeof(ItemDef), MAX_INVENTORY},
+    [SECTION_QUEST] = {"quest", offsetof(WorldDef, quests), sizeof(QuestDef), 10},
+};
+
+#define CONTENT_FIELD(section, type, field, kind) {section, #field, kind, offsetof(type, field)}
+
+// 每段的第一个字段是名称，没有名称的项视为未定义
+static const ContentField content_fields[] = {
+    CONTENT_FIELD(SECTION_SKILL, SkillDef, name, FIELD_STRING),
+    CONTENT_FIELD(SECTION_SKILL, SkillDef, mp_cost, FIELD_INT),
+    CONTENT_FIELD(SECTION_SKILL, SkillDef, damage, FIELD_INT),
+    CONTENT_FIELD(SECTION_SKILL, SkillDef, heal, FIELD_INT),
+    CONTENT_FIELD(SECTION_SKILL, SkillDef, required_level, FIELD_INT),
+    CONTENT_FIELD(SECTION_LOCATION, LocationDef, name, FIELD_STRING),
+    CONTENT_FIELD(SECTION_LOCATION, LocationDef, description, FIELD_STRING),
+    CONTENT_FIELD(SECTION_LOCATION, LocationDef, type, FIELD_INT),
+    CONTENT_FIELD(SECTION_ENEMY, EnemyDef, name, FIELD_STRING),
+    CONTENT_FIELD(SECTION_ENEMY, EnemyDef, hp, FIELD_INT),
+    CONTENT_FIELD(SECTION_ENEMY, EnemyDef, max_hp, FIELD_INT),
+    CONTENT_FIELD(SECTION_ENEMY, EnemyDef, attack, FIELD_INT),
+    CONTENT_FIELD(SECTION_ENEMY, EnemyDef, defense, FIELD_INT),
+    CONTENT_FIELD(SECTION_ENEMY, EnemyDef, exp_reward, FIELD_INT),
+    CONTENT_FIELD(SECTION_ENEMY, EnemyDef, gold_reward, FIELD_INT),
+    CONTENT_FIELD(SECTION_NPC, NpcDef, name, FIELD_STRING),
+    CONTENT_FIELD(SECTION_NPC, NpcDef, dialog, FIELD_STRING),
+    CONTENT_FIELD(SECTION_NPC, NpcDef, item_to_sell, FIELD_INT),
+    CONTENT_FIELD(SECTION_NPC, NpcDef, item_price, FIELD_INT),
+    CONTENT_FIELD(SECTION_ITEM, ItemDef, name, FIELD_STRING),
+    CONTENT_FIELD(SECTION_ITEM, ItemDef, type, FIELD_INT),
+    CONTENT_FIELD(SECTION_ITEM, ItemDef, value, FIELD_INT),
+    CONTENT_FIELD(SECTION_ITEM, ItemDef, price, FIELD_INT),
+    CONTENT_FIELD(SECTION_QUEST, QuestDef, name, FIELD_STRING),
+    CONTENT_FIELD(SECTION_QUEST, QuestDef, id, FIELD_INT),
+    CONTENT_FIELD(SECTION_QUEST, QuestDef, description, FIELD_STRING),
+    CONTENT_FIELD(SECTION_QUEST, QuestDef, completed, FIELD_INT),
+    CONTENT_FIELD(SECTION_QUEST, QuestDef, reward_exp, FIELD_INT),
+    CONTENT_FIELD(SECTION_QUEST, QuestDef, reward_gold, FIELD_INT),
+    CONTENT_FIELD(SECTION_QUEST, QuestDef, reward_item, FIELD_INT),
+};
+
+#define CONTENT_FIELD_COUNT (int)(sizeof(content_fields) / sizeof(content_fields[0]))
+
+// 源文件中的物品效果名称，按ItemEffect编号
+static const char *const item_effect_names[ITEM_EFFECTS] = {
+    "default",
+    "equip_weapon",
+    "equip_armor",
+    "heal",
+    "attack_up",
+    "agility_up",
+    "intelligence_up",
+};
+
+// 由定义生成内容包，内置世界和--compile-content都用它，返回的内存用free释放
+unsigned char *build_content(const WorldDef *def, size_t *length)
+{
+    World *world = malloc(sizeof(World));
+    StringPool strings = {0};
+
+    if (world == NULL)
+        return NULL;
+    build_world(world, &strings, def);
+
+    // 哈希表至少要有一格，查找时才能停下
+    uint32_t table_size = strings.table_size ? strings.table_size : 1;
+    size_t text_offset = sizeof(World);
+    size_t table_offset = (text_offset + strings.size + 3) & ~(size_t)3;
+    size_t size = CONTENT_OFFSET + table_offset + table_size * sizeof(uint32_t);
+
+    world->text_offset = (uint32_t)text_offset;
+    world->text_size = strings.size;
+    world->table_offset = (uint32_t)table_offset;
+    world->table_size = table_size;
+
+    unsigned char *content = calloc(size, 1);
+    if (content)
+    {
+        ContentInfo info = {sizeof(World), 0x01020304};
+        memcpy(content + SAVE_HEADER_SIZE, &info, sizeof(info));
+        memcpy(content + CONTENT_OFFSET, world, sizeof(World));
+        memcpy(content + CONTENT_OFFSET + text_offset, strings.data, strings.size);
+        if (strings.table)
+        {
+            memcpy(content + CONTENT_OFFSET + table_offset, strings.table, strings.table_size * sizeof(uint32_t));
+        }
+
+        SaveWriter writer = {content, size, size, 0};
+        *length = finish_header(&writer, "DQCP", CONTENT_VERSION);
+    }
+
+    free(strings.data);
+    free(strings.table);
+    free(world);
+    return content;
+}
+
+const World *content_world(const unsigned char *content)
+{
+    return (const World *)(content + CONTENT_OFFSET);
+}
+
+// 逐项检查世界数据中的编号、个数和偏移，内容包里的值之后会直接用作下标
+const char *check_world(const World *world)
+{
+    const uint32_t *table = (const uint32_t *)((const char *)world + world->table_offset);
+    int empty = 0;
+    for (uint32_t i = 0; i < world->table_size; i++)
+    {
+        if (table[i] == 0)
+            empty = 1;
+        else if (table[i] > world->text_size)
+            return "字符串哈希表已损坏";
+    }
+    if (!empty)
+        return "字符串哈希表已损坏"; // 没有空位时查找不会结束
+
+#define CHECK_STRING(id) \
+    if ((id) >= world->text_size) \
+        return "字符串编号超出范围"
+
+    for (int i = 0; i < MAX_SKILLS; i++)
+    {
+        CHECK_STRING(world->skills[i].name);
+    }
+    for (int i = 0; i < MAX_LOCATIONS; i++)
+    {
+        CHECK_STRING(world->locations[i].name);
+        CHECK_STRING(world->locations[i].description);
+    }
+    for (int i = 0; i < MAX_ENEMIES; i++)
+    {
+        CHECK_STRING(world->enemies[i].name);
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        CHECK_STRING(world->quests[i].name);
+        CHECK_STRING(world->quests[i].description);
+    }
+    for (int i = 0; i < MAX_INVENTORY; i++)
+    {
+        CHECK_STRING(world->items[i].name);
+        if (world->items[i].effect < 0 || world->items[i].effect >= ITEM_EFFECTS)
+            return "物品效果超出范围";
+    }
+    for (int i = 0; i < MAX_NPCS; i++)
+    {
+        const Npc *npc = &world->npcs[i];
+        CHECK_STRING(npc->name);
+        CHECK_STRING(npc->dialog);
+        for (int j = 0; j < 5; j++)
+        {
+            CHECK_STRING(npc->additional_dialogs[j]);
+        }
+        if (npc->additional_dialogs_count < 0 || npc->additional_dialogs_count > 5 ||
+            npc->shop_item_count < 0 || npc->shop_item_count > MAX_SHOP_ITEMS)
+            return "NPC数据已损坏";
+        for (int j = 0; j < npc->shop_item_count; j++)
+        {
+            if (npc->shop_items[j] < 0 || npc->shop_items[j] >= MAX_INVENTORY)
+                return "商店物品超出范围";
+        }
+    }
+#undef CHECK_STRING
+
+    for (int i = 0; i < MAX_LOCATIONS; i++)
+    {
+        const EncounterTable *encounters = &world->encounters[i];
+        if (encounters->count < 0 || encounters->count > MAX_ENCOUNTERS)
+            return "遇敌表已损坏";
+        for (int j = 0; j < encounters->count; j++)
+        {
+            if (encounters->enemies[j] < 0 || encounters->enemies[j] >= MAX_ENEMIES ||
+                encounters->aliases[j] < 0 || encounters->aliases[j] >= encounters->count)
+                return "遇敌表已损坏";
+        }
+    }
+
+    // 偏移从0开始不减少，地点的NPC才会落在location_npcs之内
+    if (world->npc_offsets[0] != 0)
+        return "地点NPC表已损坏";
+    for (int i = 0; i < MAX_LOCATIONS; i++)
+    {
+        if (world->npc_offsets[i + 1] < world->npc_offsets[i])
+            return "地点NPC表已损坏";
+    }
+    if (world->npc_offsets[MAX_LOCATIONS] > MAX_NPCS * MAX_NPC_LOCATIONS)
+        return "地点NPC表已损坏";
+    for (int i = 0; i < world->npc_offsets[MAX_LOCATIONS]; i++)
+    {
+        if (world->location_npcs[i] < 0 || world->location_npcs[i] >= MAX_NPCS)
+            return "地点NPC表已损坏";
+    }
+
+    // skills_for_level按学习等级二分查找，技能集合中也只能有已有的技能
+    if (world->skill_count < 0 || world->skill_count > MAX_SKILLS)
+        return "技能表已损坏";
+    for (int k = 1; k < world->skill_count; k++)
+    {
+        if (world->skill_levels[k] < world->skill_levels[k - 1])
+            return "技能表已损坏";
+    }
+    for (int k = 0; k <= MAX_SKILLS; k++)
+    {
+        for (int i = MAX_SKILLS; i < SKILL_WORDS * 64; i++)
+        {
+            if (world->skills_up_to[k].bits[i / 64] >> (i % 64) & 1)
+                return "技能表已损坏";
+        }
+    }
+    return NULL;
+}
+
+// 检查内容包是否能直接使用，返回错误说明，没有问题时返回NULL
+const char *check_content(const unsigned char *content, size_t length)
+{
+    int status = check_header(content, length, "DQCP", CONTENT_VERSION);
+    if (status != SAVE_OK)
+        return save_status_text(status);
+    if (length < CONTENT_OFFSET + sizeof(World))
+        return "文件不完整";
+
+    const ContentInfo *info = (const ContentInfo *)(content + SAVE_HEADER_SIZE);
+    if (info->world_size != sizeof(World) || info->byte_order != 0x01020304)
+        return "由不兼容的程序版本生成，请重新编译内容包";
+
+    const World *world = content_world(content);
+    uint64_t available = length - CONTENT_OFFSET;
+    if (world->text_offset < sizeof(World) || world->text_size == 0 ||
+        (uint64_t)world->text_offset + world->text_size > available ||
+        ((const char *)world)[world->text_offset + world->text_size - 1] != '\0')
+        return "字符串数据已损坏";
+    if (world->table_offset % sizeof(uint32_t) != 0 || world->table_size == 0 ||
+        (world->table_size & (world->table_size - 1)) != 0 ||
+        (uint64_t)world->table_offset + (uint64_t)world->table_size * sizeof(uint32_t) > available)
+        return "字符串哈希表已损坏";
+
+    return check_world(world);
+}
+
+void unmap_content(const unsigned char *content, size_t length)
+{
+#ifdef _WIN32
+    (void)length;
+    UnmapViewOfFile(content);
+#else
+    munmap((void *)content, length);
+#endif
+}
+
+// 只读映射内容包并检查，失败时显示原因并返回NULL
+const unsigned char *load_content(const char *path, size_t *length)
+{
+    const unsigned char *content = NULL;
+
+    *length = 0;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER size;
+        HANDLE mapping = NULL;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        {
+            *length = (size_t)size.QuadPart;
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        }
+        if (mapping)
+        {
+            content = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); // 映射的视图会保持文件映射对象
+        }
+        CloseHandle(file);
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            *length = (size_t)info.st_size;
+            void *map = mmap(NULL, *length, PROT_READ, MAP_SHARED, fd, 0);
+            content = map == MAP_FAILED ? NULL : map;
+        }
+        close(fd);
+    }
+#endif
+
+    if (content == NULL)
+    {
+        printf("无法读取内容包：%s\n", path);
+        return NULL;
+    }
+
+    const char *problem = check_content(content, *length);
+    if (problem)
+    {
+        printf("内容包%s无法使用：%s\n", path, problem);
+        unmap_content(content, *length);
+        return NULL;
+    }
+    return content;
+}
+
+char *trim_space(char *text)
+{
+    while (isspace((unsigned char)*text))
+    {
+        text++;
+    }
+
+    size_t length = strlen(text);
+    while (length > 0 && isspace((unsigned char)text[length - 1]))
+    {
+        text[--length] = '\0';
+    }
+    return text;
+}
+
+// 解析逗号分隔的整数列表，返回个数，格式错误或超过max个时返回-1
+int parse_int_list(const char *value, int *values, int max)
+{
+    int count = 0;
+
+    while (*value)
+    {
+        char *end;
+        long number = strtol(value, &end, 10);
+        if (end == value || count == max)
+            return -1;
+        values[count++] = (int)number;
+
+        while (isspace((unsigned char)*end))
+        {
+            end++;
+        }
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end != '\0')
+        {
+            return -1;
+        }
+        value = end;
+    }
+    return count;
+}
+
+// 检查列表中的编号都在[0, limit)中
+int check_indices(const int *values, int count, int limit)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (values[i] < 0 || values[i] >= limit)
+            return 0;
+    }
+    return 1;
+}
+
+// 设置一个字段，成功返回NULL，否则返回错误说明
+const char *set_content_field(WorldDef *def, int section, int index, const char *key, char *value)
+{
+    const ContentSectionDef *info = &content_sections[section];
+    char *entry = (char *)def + info->offset + (size_t)index * info->size;
+
+    for (int i = 0; i < CONTENT_FIELD_COUNT; i++)
+    {
+        const ContentField *field = &content_fields[i];
+        if (field->section != section || strcmp(field->key, key) != 0)
+            continue;
+
+        if (field->type == FIELD_STRING)
+        {
+            *(const char **)(entry + field->offset) = value;
+        }
+        else if (parse_int_list(value, (int *)(entry + field->offset), 1) != 1)
+        {
+            return "应为一个整数";
+        }
+        return NULL;
+    }
+
+    if (section == SECTION_ITEM)
+    {
+        ItemDef *item = &def->items[index];
+        if (strcmp(key, "effect") == 0)
+        {
+            for (int i = 0; i < ITEM_EFFECTS; i++)
+            {
+                if (strcmp(value, item_effect_names[i]) == 0)
+                {
+                    item->effect = i;
+                    return NULL;
+                }
+            }
+            return "未知的物品效果";
+        }
+        if (strcmp(key, "args") == 0)
+        {
+            return parse_int_list(value, item->args, 2) < 0 ? "应为最多两个整数" : NULL;
+        }
+    }
+    else if (section == SECTION_NPC)
+    {
+        NpcDef *npc = &def->npcs[index];
+        if (strcmp(key, "additional_dialog") == 0)
+        {
+            if (npc->additional_dialogs_count == 5)
+                return "额外对话最多5句";
+            npc->additional_dialogs[npc->additional_dialogs_count++] = value;
+            return NULL;
+        }
+        if (strcmp(key, "shop_items") == 0)
+        {
+            npc->shop_item_count = parse_int_list(value, npc->shop_items, MAX_SHOP_ITEMS);
+            if (npc->shop_item_count < 0 || !check_indices(npc->shop_items, npc->shop_item_count, MAX_INVENTORY))
+                return "应为物品编号的列表";
+            return NULL;
+        }
+        if (strcmp(key, "locations") == 0)
+        {
+            npc->location_count = parse_int_list(value, npc->locations, MAX_NPC_LOCATIONS);
+            if (npc->location_count < 0 || !check_indices(npc->locations, npc->location_count, MAX_LOCATIONS))
+                return "应为地点编号的列表";
+            return NULL;
+        }
+    }
+    else if (section == SECTION_LOCATION && strcmp(key, "encounter") == 0)
+    {
+        int values[2];
+        if (parse_int_list(value, values, 2) != 2 || !check_indices(values, 1, MAX_ENEMIES) || values[1] <= 0)
+            return "应为\"敌人编号, 权重\"";
+
+        EncounterDef *encounters = def->encounters[index];
+        for (int i = 0; i < MAX_ENCOUNTERS; i++)
+        {
+            if (encounters[i].weight == 0)
+            {
+                encounters[i].enemy = values[0];
+                encounters[i].weight = values[1];
+                return NULL;
+            }
+        }
+        return "每个地点最多16种敌人";
+    }
+
+    return "未知的键";
+}
+
+// 解析内容源文件，定义中的文字直接指向source
+int parse_content(char *source, const char *path, WorldDef *def)
+{
+    int section = SECTION_NONE;
+    int index = 0;
+    int line_number = 0;
+    char *next = source;
+
+    while (next)
+    {
+        char *line = next;
+        next = strchr(line, '\n');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+        line_number++;
+
+        line = trim_space(line);
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        const char *error = NULL;
+        if (line[0] == '[')
+        {
+            char name[16];
+            char end;
+            section = SECTION_NONE;
+            if (sscanf(line, "[%15s %d %c", name, &index, &end) == 3 && end == ']')
+            {
+                for (int i = SECTION_NONE + 1; i < CONTENT_SECTIONS; i++)
+                {
+                    if (strcmp(name, content_sections[i].name) == 0)
+                    {
+                        section = i;
+                    }
+                }
+            }
+
+            if (section == SECTION_NONE)
+            {
+                error = "应为[类型 编号]";
+            }
+            else if (index < 0 || index >= content_sections[section].count)
+            {
+                error = "编号超出范围";
+                section = SECTION_NONE;
+            }
+            else if (section == SECTION_NPC && def->npcs[index].name == NULL)
+            {
+                def->npcs[index].item_to_sell = -1; // 默认不卖物品
+            }
+        }
+        else
+        {
+            char *equals = strchr(line, '=');
+            if (section == SECTION_NONE || equals == NULL)
+            {
+                error = "应为\"键 = 值\"";
+            }
+            else
+            {
+                *equals = '\0';
+                error = set_content_field(def, section, index, trim_space(line), trim_space(equals + 1));
+            }
+        }
+
+        if (error)
+        {
+            printf("%s第%d行：%s\n", path, line_number, error);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void write_int_list(FILE *file, const char *key, const int *values, int count)
+{
+    fprintf(file, "%s = ", key);
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(file, i ? ", %d" : "%d", values[i]);
+    }
+    fprintf(file, "\n");
+}
+
+// 把定义写成内容源文件，编译后得到同样的世界
+void write_content_source(FILE *file, const WorldDef *def)
+{
+    fprintf(file, "# 勇者斗恶龙内容源文件，用 --compile-content 编译为内容包\n");
+    fprintf(file, "# 每段以[类型 编号]开头，之后每行一个\"键 = 值\"，列表用逗号分隔，#开头的行是注释\n");
+
+    for (int section = SECTION_NONE + 1; section < CONTENT_SECTIONS; section++)
+    {
+        const ContentSectionDef *info = &content_sections[section];
+        for (int index = 0; index < info->count; index++)
+        {
+            const char *entry = (const char *)def + info->offset + (size_t)index * info->size;
+            int first = 1;
+
+            for (int i = 0; i < CONTENT_FIELD_COUNT; i++)
+            {
+                const ContentField *field = &content_fields[i];
+                if (field->section != section)
+                    continue;
+
+                if (field->type == FIELD_STRING)
+                {
+                    const char *value = *(const char *const *)(entry + field->offset);
+                    if (first && value == NULL)
+                        break; // 未定义的项
+                    if (first)
+                    {
+                        fprintf(file, "\n[%s %d]\n", info->name, index);
+                    }
+                    fprintf(file, "%s = %s\n", field->key, value ? value : "");
+                }
+                else
+                {
+                    fprintf(file, "%s = %d\n", field->key, *(const int *)(entry + field->offset));
+                }
+                first = 0;
+            }
+            if (first)
+                continue;
+
+            if (section == SECTION_ITEM)
+            {
+                const ItemDef *item = &def->items[index];
+                if (item->effect != EFFECT_DEFAULT)
+                {
+                    fprintf(file, "effect = %s\n", item_effect_names[item->effect]);
+                }
+                if (item->args[0] || item->args[1])
+                {
+                    write_int_list(file, "args", item->args, 2);
+                }
+            }
+            else if (section == SECTION_NPC)
+            {
+                const NpcDef *npc = &def->npcs[index];
+                for (int i = 0; i < npc->additional_dialogs_count; i++)
+                {
+                    const char *dialog = npc->additional_dialogs[i];
+                    fprintf(file, "additional_dialog = %s\n", dialog ? dialog : "");
+                }
+                if (npc->shop_item_count > 0)
+                {
+                    write_int_list(file, "shop_items", npc->shop_items, npc->shop_item_count);
+                }
+                if (npc->location_count > 0)
+                {
+                    write_int_list(file, "locations", npc->locations, npc->location_count);
+                }
+            }
+            else if (section == SECTION_LOCATION)
+            {
+                for (int i = 0; i < MAX_ENCOUNTERS; i++)
+                {
+                    const EncounterDef *encounter = &def->encounters[index][i];
+                    if (encounter->weight > 0)
+                    {
+                        fprintf(file, "encounter = %d, %d\n", encounter->enemy, encounter->weight);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// 用法: Dragon_Quest --compile-content 源文件 内容包
+int compile_content(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        printf("用法: --compile-content 源文件 内容包\n");
+        return 1;
+    }
+
+    size_t length;
+    unsigned char *data = load_file(argv[0], &length);
+    char *source = data ? realloc(data, length + 1) : NULL;
+    if (source == NULL)
+    {
+        printf("无法读取内容源文件：%s\n", argv[0]);
+        free(data);
+        return 1;
+    }
+    source[length] = '\0';
+
+    WorldDef *def = calloc(1, sizeof(WorldDef));
+    unsigned char *content = NULL;
+    size_t size = 0;
+    int ok = def != NULL && parse_content(source, argv[0], def);
+    if (ok)
+    {
+        content = build_content(def, &size);
+        ok = content != NULL && write_file_atomic(argv[1], content, size);
+        if (ok)
+        {
+            printf("已生成内容包%s，共%zu字节。\n", argv[1], size);
+        }
+        else
+        {
+            printf("无法写入内容包：%s\n", argv[1]);
+        }
+    }
+
+    free(content);
+    free(def);
+    free(source);
+    return ok ? 0 : 1;
+}
+
+// 用法: Dragon_Quest --export-content 源文件
+int export_content(int argc, char *argv[])
+{
+    if (argc != 1)
+    {
+        printf("用法: --export-content 源文件\n");
+        return 1;
+    }
+
+    FILE *file = fopen(argv[0], "w");
+    if (file == NULL)
+    {
+        printf("无法写入内容源文件：%s\n", argv[0]);
+        return 1;
+    }
+    write_content_source(file, &builtin_world_def);
+    int ok = fclose(file) == 0;
+    if (ok)
+    {
+        printf("已导出内置世界到%s。\n", argv[0]);
+    }
+    return ok ? 0 : 1;
+}
+
+// ========== 服务器 ==========
+// --server 端口 或 --server unix:路径
+// 每个CPU核心一个工作线程，各自有epoll和会话链表，连接按顺序分到各个分片，只有第一个线程接受连接。
+// 会话用EPOLLONESHOT注册，可读时压入所属线程的工作窃取队列，空闲的线程从别的队列窃取，
+// 同一个会话同时只由一个线程处理。收到的每个完整输入交给game_step，
+// 读不到完整输入就停在当前菜单，重新注册后等下一次可读。
+
+#ifdef __linux__
+
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+int open_listener(const char *address)
+{
+    int fd;
+
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        snprintf(local.sun_path, sizeof(local.sun_path), "%s", address + 5);
+        unlink(local.sun_path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0)
+            goto fail;
     }
     else
     {
-        printf("无效的选择。\n");
+        struct sockaddr_in local;
+        int reuse = 1;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+        local.sin_port = htons((uint16_t)atoi(address));
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            goto fail;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0)
+            goto fail;
+    }
+
+    if (listen(fd, SOMAXCONN) != 0 || !set_nonblocking(fd))
+        goto fail;
+    return fd;
+
+fail:
+    if (fd >= 0)
+    {
+        close(fd);
     }
+    return -1;
 }
 
-// 战斗系统
-void battle(GameData *game)
+// 非阻塞读取，没有数据时返回-1，会话停在当前菜单，等连接再次可读
+int session_source(void *context, char *buffer, int size)
 {
-    // 如果恶龙已被击败
-    if (game->dragon_defeated && game->current_location == 3)
+    Session *session = context;
+
+    for (;;)
     {
-        printf("恶龙已经被你击败了，龙之城堡现在是一片废墟。\n");
-        return;
+        ssize_t length = recv(session->fd, buffer, size, 0);
+        if (length >= 0)
+            return (int)length;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        return 0;
     }
+}
 
-    int enemy_type;
-    switch (game->current_location)
+// ---------- 内存池 ----------
+
+SlabPool slab_pools[SLAB_POOLS] = {
+    {"会话", sizeof(Session), MUTEX_INITIALIZER},
+    {"会话状态", sizeof(SessionState), MUTEX_INITIALIZER}};
+
+_Thread_local SlabCache slab_caches[SLAB_POOLS];
+
+volatile sig_atomic_t slab_report_requested = 0;
+
+// 返回清零的对象，失败返回NULL
+void *slab_alloc(int pool_id)
+{
+    SlabPool *pool = &slab_pools[pool_id];
+    SlabCache *cache = &slab_caches[pool_id];
+
+    if (cache->head == NULL)
     {
-    case 0: // 村庄
-        printf("在村庄里很安全，没有敌人。\n");
-        return;
-    case 1: // 森林 - 哥布林、狼或毒蛇
-        enemy_type = rand() % 3;
-        if (enemy_type == 2)
-            enemy_type = 11; // 毒蛇
-        break;
-    case 2: // 洞穴 - 骷髅战士或木乃伊
-        enemy_type = (rand() % 2) ? 2 : 16;
-        break;
-    case 3: // 城堡 - 恶龙
-        enemy_type = 3;
-        break;
-    case 4: // 王城 - 安全区域
-        printf("在王城里很安全，没有敌人。\n");
+        // 从共享的空闲链表取一批，不够时申请新的一块
+        mutex_lock(&pool->lock);
+        if (pool->free_list == NULL)
+        {
+            char *slab = malloc(pool->size * SLAB_OBJECTS);
+            if (slab)
+            {
+                for (int i = 0; i < SLAB_OBJECTS; i++)
+                {
+                    SlabObject *object = (SlabObject *)(slab + pool->size * i);
+                    object->next = pool->free_list;
+                    pool->free_list = object;
+                }
+                atomic_fetch_add_explicit(&pool->slabs, 1, memory_order_relaxed);
+            }
+        }
+        while (pool->free_list && cache->count < SLAB_CACHE_SIZE / 2)
+        {
+            SlabObject *object = pool->free_list;
+            pool->free_list = object->next;
+            object->next = cache->head;
+            cache->head = object;
+            cache->count++;
+        }
+        mutex_unlock(&pool->lock);
+
+        if (cache->head == NULL)
+            return NULL;
+    }
+
+    SlabObject *object = cache->head;
+    cache->head = object->next;
+    cache->count--;
+
+    atomic_fetch_add_explicit(&pool->allocations, 1, memory_order_relaxed);
+    long in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    long high_water = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+    while (in_use > high_water &&
+           !atomic_compare_exchange_weak_explicit(&pool->high_water, &high_water, in_use,
+                                                  memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+
+    memset(object, 0, pool->size);
+    return object;
+}
+
+// 对象可以在任何线程释放，线程缓存满时把一半还给共享链表
+void slab_free(int pool_id, void *pointer)
+{
+    SlabPool *pool = &slab_pools[pool_id];
+    SlabCache *cache = &slab_caches[pool_id];
+    SlabObject *object = pointer;
+
+    if (object == NULL)
         return;
-    case 5: // 沙漠绿洲 - 沙漠蝎子
-        enemy_type = 4;
-        break;
-    case 6: // 雪山之巅 - 雪怪或冰霜巨龙
-        enemy_type = (rand() % 2) ? 5 : 17;
-        break;
-    case 7: // 地下城 - 石像鬼或恶魔
-        enemy_type = 8 + (rand() % 2);
-        break;
-    case 8: // 精灵之森 - 精灵法师
-        enemy_type = (rand() % 2) ? 7 : 16;
-        break;
-    case 9: // 海盗港湾 - 海盗
-        enemy_type = 6;
-        break;
-    case 10: // 火山口 - 火焰巨人或熔岩元素
-        enemy_type = (rand() % 2) ? 10 : 19;
-        break;
-    case 11: // 古代遗迹 - 堕天使或混沌体或虚空行者
-        enemy_type = (rand() % 3) + 21;
-        break;
-    case 12: // 黑暗沼泽 - 幽灵或石头人或黑暗法师
-        enemy_type = (rand() % 2) ? 11 : 12;
-        break;
-    case 13: // 魔法学院
-        printf("在魔法学院里很安全，没有敌人。\n");
+
+    object->next = cache->head;
+    cache->head = object;
+    cache->count++;
+
+    atomic_fetch_add_explicit(&pool->frees, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+
+    if (cache->count > SLAB_CACHE_SIZE)
+    {
+        mutex_lock(&pool->lock);
+        while (cache->count > SLAB_CACHE_SIZE / 2)
+        {
+            object = cache->head;
+            cache->head = object->next;
+            cache->count--;
+            object->next = pool->free_list;
+            pool->free_list = object;
+        }
+        mutex_unlock(&pool->lock);
+    }
+}
+
+void slab_report(FILE *file)
+{
+    for (int i = 0; i < SLAB_POOLS; i++)
+    {
+        SlabPool *pool = &slab_pools[i];
+        long slabs = atomic_load(&pool->slabs);
+        fprintf(file, "内存池 %s: 分配%ld次，释放%ld次，使用中%ld，最高%ld，共%ld块 %ldKB\n",
+                pool->name, atomic_load(&pool->allocations), atomic_load(&pool->frees),
+                atomic_load(&pool->in_use), atomic_load(&pool->high_water), slabs,
+                (long)(slabs * SLAB_OBJECTS * pool->size / 1024));
+    }
+    fflush(file);
+}
+
+// 收到SIGUSR1时由第一个工作线程输出统计
+void request_slab_report(int signal_number)
+{
+    (void)signal_number;
+    slab_report_requested = 1;
+}
+
+// ---------- 内容包热更新 ----------
+// 新的内容包载入后原子地发布，会话处理输入前不加锁地比较一次指针。
+// 会话回到主菜单时才换用新的世界，战斗中的会话用旧的数值打完这一场。
+// 旧版本由仍在使用它的会话计数，最后一个会话换走或断开后解除映射。
+
+Mutex content_lock = MUTEX_INITIALIZER;
+ContentVersion *content_version;        // 最新版本，由content_lock保护
+_Atomic(const World *) published_world; // 最新版本的世界
+atomic_uint published_generation;      // 最新版本的generation
+
+volatile sig_atomic_t content_reload_requested = 0;
+
+// 收到SIGHUP时由第一个工作线程重新载入内容包
+void request_content_reload(int signal_number)
+{
+    (void)signal_number;
+    content_reload_requested = 1;
+}
+
+ContentVersion *acquire_content(void)
+{
+    mutex_lock(&content_lock);
+    ContentVersion *version = content_version;
+    version->users++;
+    mutex_unlock(&content_lock);
+    return version;
+}
+
+void release_content(ContentVersion *version)
+{
+    mutex_lock(&content_lock);
+    int unused = --version->users == 0;
+    mutex_unlock(&content_lock);
+
+    if (unused)
+    {
+        if (version->content)
+        {
+            unmap_content(version->content, version->length);
+        }
+        free(version);
+    }
+}
+
+void reload_content(void)
+{
+    if (content_path == NULL)
+    {
+        printf("没有使用内容包，无法重新载入。\n");
+        fflush(stdout);
+        return;
+    }
+
+    size_t length;
+    const unsigned char *content = load_content(content_path, &length);
+    ContentVersion *version = content ? calloc(1, sizeof(ContentVersion)) : NULL;
+    if (version == NULL)
+    {
+        if (content)
+        {
+            unmap_content(content, length);
+        }
+        printf("继续使用原来的内容包。\n");
+        fflush(stdout);
         return;
-    case 14: // 幽灵船 - 幽灵或刺客
-        enemy_type = (rand() % 2) ? 12 : 18;
-    case 15: // 决斗场 - 奥赛罗
-        enemy_type = 24;
-        break;
-    default:
-        enemy_type = rand() % 10;
     }
+    version->content = content;
+    version->length = length;
+    version->world = content_world(content);
+    version->users = 1;
+
+    mutex_lock(&content_lock);
+    ContentVersion *old = content_version;
+    version->generation = old->generation + 1;
+    content_version = version;
+    atomic_store_explicit(&published_world, version->world, memory_order_release);
+    atomic_store_explicit(&published_generation, version->generation, memory_order_release);
+    mutex_unlock(&content_lock);
+    release_content(old);
+
+    printf("已重新载入内容包%s\n", content_path);
+    fflush(stdout);
+}
 
-    Enemy enemy = game->enemies[enemy_type];
-    printf("\n遭遇了%s！\n", enemy.name);
+// 在主菜单把会话换到最新的世界。和读档一样经过存档格式，物品按名称对应到新的编号
+void update_session_content(Session *session)
+{
+    GameData *game = &session->state->game;
+    if (game->menu.id != MENU_MAIN ||
+        atomic_load_explicit(&published_world, memory_order_acquire) == game->world ||
+        atomic_load_explicit(&published_generation, memory_order_acquire) == session->failed_generation)
+        return;
 
-    while (game->player.hp > 0 && enemy.hp > 0)
+    ContentVersion *version = acquire_content();
+    unsigned char save[SAVE_MAX_SIZE];
+    size_t length = save_encode(game, save, sizeof(save));
+    const World *old_world = game->world;
+    game->world = version->world;
+    if (length == 0 || save_decode(game, save, length) != SAVE_OK)
     {
-        int choice, damage;
-
-        printf("\n---------- 战斗信息 ----------\n");
-        printf("%s 生命值: %d/%d\n", enemy.name, enemy.hp, enemy.max_hp);
-        printf("%s 生命值: %d/%d\n", game->player.name, game->player.hp, game->player.max_hp);
-        printf("魔法值: %d/%d\n", game->player.mp, game->player.max_mp);
-        printf("-----------------------------\n");
+        // 新的世界缺少背包中的物品，继续使用旧的世界，直到发布下一个版本
+        game->world = old_world;
+        session->failed_generation = version->generation;
+        printf("连接%d无法换用第%u个内容包版本，继续使用原来的世界。\n", session->fd, version->generation);
+        fflush(stdout);
+        release_content(version);
+        return;
+    }
 
-        printf("1. 普通攻击\n");
-        printf("2. 使用技能\n");
-        printf("3. 逃跑\n");
-        printf("请选择行动: ");
+    release_content(session->content);
+    session->content = version;
+}
 
-        scanf("%d", &choice);
+// ---------- 工作窃取队列 (Chase-Lev) ----------
+// 只有所属的工作线程在底部压入和弹出，其他线程从顶部窃取，全程无锁。
 
-        switch (choice)
-        {
-        case 1: // 普通攻击
-            damage = calculate_damage(game->player.attack, enemy.defense);
-            enemy.hp -= damage;
-            printf("你对%s造成了%d点伤害！\n", enemy.name, damage);
-            // 击败恶龙
-            if (enemy_type == 3 && enemy.hp <= 0 && !game->dragon_defeated)
-            {
-                printf("你击败了%s！\n", enemy.name);
-                game->player.exp += enemy.exp_reward;
-                game->player.gold += enemy.gold_reward;
-                printf("获得了%d经验值和%d金币！\n", enemy.exp_reward, enemy.gold_reward);
+int work_push(WorkDeque *deque, Session *session)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
 
-                game->dragon_defeated = 1;
+    if (bottom - top >= WORK_DEQUE_SIZE)
+        return 0;
 
-                show_ending(game);
+    atomic_store_explicit(&deque->items[bottom & (WORK_DEQUE_SIZE - 1)], session, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 1;
+}
 
-                if (game->player.exp >= game->player.level * 100)
-                {
-                    level_up(game);
-                }
+Session *work_pop(WorkDeque *deque)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
 
-                return;
-            }
+    if (top > bottom)
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
 
-            if (enemy.hp <= 0)
-            {
-                printf("你击败了%s！\n", enemy.name);
-                game->player.exp += enemy.exp_reward;
-                game->player.gold += enemy.gold_reward;
-                printf("获得了%d经验值和%d金币！\n", enemy.exp_reward, enemy.gold_reward);
+    Session *session = atomic_load_explicit(&deque->items[bottom & (WORK_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (top == bottom)
+    {
+        // 最后一个，和窃取者竞争
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+        {
+            session = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return session;
+}
 
-                if (game->player.exp >= game->player.level * 100)
-                {
-                    level_up(game);
-                }
-                return;
-            }
-            break;
+Session *work_steal(WorkDeque *deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom)
+        return NULL;
+
+    Session *session = atomic_load_explicit(&deque->items[top & (WORK_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return session;
+}
 
-        case 2: // 使用技能
-        {
-            printf("\n可用技能:\n");
-            int skill_count = 0;
-            int available_skills[20];
+// ---------- 会话 ----------
 
-            for (int i = 0; i < game->learned_skill_count; i++)
-            {
-                int skill_index = game->learned_skills[i];
-                Skill *skill = &game->skills[skill_index];
+// 游戏结束后发完剩下的输出再断开
+int session_finished(Session *session)
+{
+    return session->broken || (session->state->game.menu.id == MENU_QUIT && session->state->output.size == 0);
+}
 
-                // 检查玩家等级是否满足技能要求
-                if (game->player.level >= skill->required_level)
-                {
-                    if (game->player.mp >= skill->mp_cost)
-                    {
-                        printf("%d. %s (消耗%d MP)\n", skill_count + 1, skill->name, skill->mp_cost);
-                    }
-                    else
-                    {
-                        printf("%d. %s (消耗%d MP) [MP不足]\n", skill_count + 1, skill->name, skill->mp_cost);
-                    }
-                    available_skills[skill_count] = skill_index;
-                    skill_count++;
-                }
-            }
+// 尽量发送缓冲的输出，发不完时等待EPOLLOUT
+void session_flush(Session *session)
+{
+    Output *output = &session->state->output;
 
-            if (skill_count == 0)
-            {
-                printf("你目前没有可以使用的技能！\n");
+    while (session->sent < output->size)
+    {
+        ssize_t length = send(session->fd, output->data + session->sent, output->size - session->sent, MSG_NOSIGNAL);
+        if (length < 0)
+        {
+            if (errno == EINTR)
                 continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                session->broken = 1;
             }
+            return;
+        }
+        session->sent += (size_t)length;
+    }
 
-            printf("请选择技能 (0返回): ");
-            int skill_choice;
-            scanf("%d", &skill_choice);
-
-            if (skill_choice == 0)
-                continue;
+    output->size = 0;
+    session->sent = 0;
+}
 
-            skill_choice--;
+// 在所属分片的epoll中重新登记，EPOLLONESHOT保证同一时刻只有一个线程在处理这个会话
+int watch_session(Session *session, int operation)
+{
+    struct epoll_event event;
 
-            if (skill_choice >= 0 && skill_choice < skill_count)
-            {
-                Skill *skill = &game->skills[available_skills[skill_choice]];
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    if (session->state && session->state->output.size > 0)
+    {
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = session;
+    return epoll_ctl(session->owner->epoll_fd, operation, session->fd, &event) == 0;
+}
 
-                if (game->player.mp >= skill->mp_cost)
-                {
-                    game->player.mp -= skill->mp_cost;
+// 处理已经收到的所有输入并发送输出，之后重新等待事件或关闭连接
+void run_session(Session *session)
+{
+    claim_session(session);
+    if (session->state == NULL && !wake_session(session))
+    {
+        close_session(session);
+        return;
+    }
 
-                    int base_damage = skill->damage + game->player.attack;  // 技能伤害+玩家攻击
-                    int intelligence_bonus = game->player.intelligence / 2; // 智力每2点增加1点技能伤害
-                    damage = base_damage + intelligence_bonus;
+    SessionState *state = session->state;
+    session_flush(session);
+    while (!session->broken && input_ready(&state->input))
+    {
+        update_session_content(session);
+        if (!game_step(&state->game))
+            break;
+    }
+    session_flush(session);
 
-                    enemy.hp -= damage;
-                    printf("你使用%s对%s造成了%d点伤害！(技能伤害%d + 攻击力%d + 智力加成%d)\n",
-                           skill->name, enemy.name, damage, skill->damage, game->player.attack, intelligence_bonus);
+    if (session_finished(session))
+    {
+        close_session(session);
+        return;
+    }
 
-                    if (skill->heal > 0)
-                    {
-                        int heal_amount = skill->heal;
-                        game->player.hp += heal_amount;
-                        if (game->player.hp > game->player.max_hp)
-                        {
-                            game->player.hp = game->player.max_hp;
-                        }
-                        printf("你使用%s恢复了%d点生命值！\n", skill->name, heal_amount);
-                    }
+    touch_session(session);
+    if (!watch_session(session, EPOLL_CTL_MOD))
+    {
+        close_session(session);
+        return;
+    }
+    release_session(session);
+}
 
-                    // 击败恶龙
-                    if (enemy_type == 3 && enemy.hp <= 0 && !game->dragon_defeated)
-                    {
-                        printf("你击败了%s！\n", enemy.name);
-                        game->player.exp += enemy.exp_reward;
-                        game->player.gold += enemy.gold_reward;
-                        printf("获得了%d经验值和%d金币！\n", enemy.exp_reward, enemy.gold_reward);
+void close_session(Session *session)
+{
+    mutex_lock(&session->owner->lock);
+    unlink_session(session);
+    mutex_unlock(&session->owner->lock);
 
-                        game->dragon_defeated = 1;
+    close(session->fd);
+    if (session->state)
+    {
+        free(session->state->output.data);
+        slab_free(SLAB_SESSION_STATE, session->state);
+    }
+    free(session->image);
+    release_content(session->content);
+    slab_free(SLAB_SESSION, session);
+}
 
-                        show_ending(game);
+// 新连接按顺序分配到各个分片
+void open_session(Server *server, int fd)
+{
+    Session *session = slab_alloc(SLAB_SESSION);
+    SessionState *state = slab_alloc(SLAB_SESSION_STATE);
+    if (session == NULL || state == NULL)
+    {
+        slab_free(SLAB_SESSION, session);
+        slab_free(SLAB_SESSION_STATE, state);
+        close(fd);
+        return;
+    }
 
-                        if (game->player.exp >= game->player.level * 100)
-                        {
-                            level_up(game);
-                        }
+    session->owner = &server->workers[server->session_count % server->worker_count];
+    session->fd = fd;
+    session->state = state;
+    atomic_init(&session->busy, 1);
+    state->output.capture = 1;
+    input_init(&state->input, session_source, session);
+    state->game.input = &state->input;
+    state->game.output = &state->output;
+    session->content = acquire_content();
+    state->game.world = session->content->world;
+    rng_seed(&state->game.rng, server->seed + (uint64_t)server->session_count);
+    server->session_count++;
+
+    start_game(&state->game);
+    session_flush(session);
+    if (session->broken)
+    {
+        close_session(session);
+        return;
+    }
 
-                        return;
-                    }
+    touch_session(session);
+    if (!watch_session(session, EPOLL_CTL_ADD))
+    {
+        close_session(session);
+        return;
+    }
+    release_session(session);
+}
 
-                    if (enemy.hp <= 0)
-                    {
-                        printf("你击败了%s！\n", enemy.name);
-                        game->player.exp += enemy.exp_reward;
-                        game->player.gold += enemy.gold_reward;
-                        printf("获得了%d经验值和%d金币！\n", enemy.exp_reward, enemy.gold_reward);
-
-                        if (game->player.exp >= game->player.level * 100)
-                        {
-                            level_up(game);
-                        }
-                        return;
-                    }
-                }
-                else
-                {
-                    printf("MP不足，无法使用此技能！\n");
-                    continue;
-                }
-            }
-            else
-            {
-                printf("无效的技能选择。\n");
+void accept_sessions(Server *server)
+{
+    for (;;)
+    {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
                 continue;
-            }
+            return; // EAGAIN，或者文件描述符用完了
         }
-        break;
 
-        case 3: // 逃跑
-            if (enemy_type == 3)
-            {
-                printf("恶龙的强大气息让你无法移动！\n");
-            }
-            else
-            {
-                int enemy_level = estimate_enemy_level(&enemy);
+        if (!set_nonblocking(fd))
+        {
+            close(fd);
+            continue;
+        }
+        open_session(server, fd);
+    }
+}
 
-                // 根据等级与敌人等级差计算逃跑率
-                int escape_chance = 50 + (game->player.level - enemy_level) * 5;
+// ---------- 休眠 ----------
+// 大部分连接长时间停在提示处。空闲超过时限的会话只保留存档记录、随机数和菜单状态，
+// 释放GameData、输入和输出缓冲，收到下一次输入时再恢复。
 
-                escape_chance += (game->player.agility / 10) * 5;
+// 会话只能同时由一个线程处理或休眠
+void claim_session(Session *session)
+{
+    int busy = 0;
+    while (!atomic_compare_exchange_weak(&session->busy, &busy, 1))
+    {
+        busy = 0;
+        sched_yield();
+    }
+}
 
-                if (escape_chance < 10)
-                    escape_chance = 10;
-                if (escape_chance > 90)
-                    escape_chance = 90;
+void release_session(Session *session)
+{
+    atomic_store(&session->busy, 0);
+}
 
-                if (rand() % 100 < escape_chance)
-                {
-                    printf("你成功逃跑了！(逃跑率: %d%%)\n", escape_chance);
-                    return;
-                }
-                else
-                {
-                    printf("逃跑失败！(逃跑率: %d%%)\n", escape_chance);
-                }
-            }
-            break;
+// 从分片的活动链表中移除，调用者持有分片的锁
+void unlink_session(Session *session)
+{
+    Worker *worker = session->owner;
 
-        default:
-            printf("无效的选择。\n");
-            continue;
-        }
+    if (!session->listed)
+        return;
 
-        if (enemy.hp > 0)
-        {
-            int enemy_level = estimate_enemy_level(&enemy);
-            int dodge_chance = (game->player.agility / 5 - enemy_level);
-            if (dodge_chance > 90)
-                dodge_chance = 90;
-            if (dodge_chance < 0)
-                dodge_chance = 0;
+    if (session->prev)
+        session->prev->next = session->next;
+    else
+        worker->active_head = session->next;
+    if (session->next)
+        session->next->prev = session->prev;
+    else
+        worker->active_tail = session->prev;
 
-            if (rand() % 100 < dodge_chance)
-            {
-                printf("%s试图攻击你，但你敏捷地闪避开了！(闪避率: %d%%)\n", enemy.name, dodge_chance);
-            }
-            else
-            {
-                int damage = calculate_damage(enemy.attack, game->player.defense);
-                game->player.hp -= damage;
-                printf("%s对你造成了%d点伤害！\n", enemy.name, damage);
-            }
+    session->prev = NULL;
+    session->next = NULL;
+    session->listed = 0;
+}
 
-            if (game->player.hp <= 0)
-            {
-                printf("你被%s击败了...\n", enemy.name);
-                printf("游戏结束！\n");
-                exit(0);
-            }
-        }
+// 刚处理过输入的会话移到链表末尾，链表头部是最久没有输入的会话
+void touch_session(Session *session)
+{
+    Worker *worker = session->owner;
+
+    mutex_lock(&worker->lock);
+    unlink_session(session);
+    session->active = time(NULL);
+    session->prev = worker->active_tail;
+    if (worker->active_tail)
+        worker->active_tail->next = session;
+    else
+        worker->active_head = session;
+    worker->active_tail = session;
+    session->listed = 1;
+    mutex_unlock(&worker->lock);
+}
+
+// 把会话压缩成紧凑的记录，还有输出没发完时不休眠
+int hibernate_session(Session *session)
+{
+    SessionState *state = session->state;
+    GameData *game = &state->game;
+    Input *input = &state->input;
+    const Menu *menu = &game->menu;
+    unsigned char save[SAVE_MAX_SIZE];
+    unsigned char buffer[SAVE_MAX_SIZE + 1024];
+    SaveWriter writer = {buffer, sizeof(buffer), 0, 0};
+
+    if (state->output.size > 0 || input->eof)
+        return 0;
+
+    size_t length = save_encode(game, save, sizeof(save));
+    if (length == 0)
+        return 0;
+
+    put_varint(&writer, length);
+    put_bytes(&writer, save, length);
+    for (int i = 0; i < 4; i++)
+    {
+        put_varint(&writer, game->rng.s[i]);
     }
+
+    put_varint(&writer, menu->id);
+    put_svarint(&writer, menu->npc_index);
+    put_string(&writer, menu->player);
+    put_svarint(&writer, menu->battle.enemy_type);
+    put_svarint(&writer, menu->battle.enemy.hp);
+    put_varint(&writer, menu->battle.turns);
+    put_varint(&writer, menu->battle.result);
+
+    // 已经收到但还不是完整输入的部分
+    put_varint(&writer, input->length - input->pos);
+    put_bytes(&writer, input->data + input->pos, input->length - input->pos);
+
+    if (writer.overflow)
+        return 0;
+
+    unsigned char *image = malloc(writer.size);
+    if (image == NULL)
+        return 0;
+    memcpy(image, buffer, writer.size);
+
+    session->image = image;
+    session->image_size = writer.size;
+    session->state = NULL;
+    free(state->output.data);
+    slab_free(SLAB_SESSION_STATE, state);
+    return 1;
 }
 
-void rest(GameData *game)
+// 从休眠记录恢复完整的会话状态
+int wake_session(Session *session)
 {
+    SessionState *state = slab_alloc(SLAB_SESSION_STATE);
+    SaveReader reader = {session->image, session->image_size, 0, 0};
 
-    if (game->locations[game->current_location].type == 0 ||
-        game->locations[game->current_location].type == 4)
+    if (state == NULL)
+        return 0;
+
+    GameData *game = &state->game;
+    Input *input = &state->input;
+    Menu *menu = &game->menu;
+
+    state->output.capture = 1;
+    input_init(input, session_source, session);
+    game->input = input;
+    game->output = &state->output;
+    game->world = session->content->world; // 休眠前在打的战斗继续使用原来的世界
+
+    uint64_t length = get_varint(&reader);
+    if (reader.error || length > reader.size - reader.pos ||
+        save_decode(game, reader.data + reader.pos, (size_t)length) != SAVE_OK)
     {
-        int restore_hp = game->player.max_hp - game->player.hp;
-        int restore_mp = game->player.max_mp - game->player.mp;
+        slab_free(SLAB_SESSION_STATE, state);
+        return 0;
+    }
+    reader.pos += (size_t)length;
 
-        game->player.hp = game->player.max_hp;
-        game->player.mp = game->player.max_mp;
+    for (int i = 0; i < 4; i++)
+    {
+        game->rng.s[i] = get_varint(&reader);
+    }
 
-        printf("你在这里好好休息了一番...\n");
-        printf("恢复了%d点生命值和%d点魔法值！\n", restore_hp, restore_mp);
+    menu->id = (int)get_varint(&reader);
+    menu->npc_index = (int)get_svarint(&reader);
+    get_string(&reader, menu->player, sizeof(menu->player));
+    menu->battle.enemy_type = (int)get_svarint(&reader);
+    if (menu->battle.enemy_type >= 0 && menu->battle.enemy_type < MAX_ENEMIES)
+    {
+        menu->battle.enemy = game->world->enemies[menu->battle.enemy_type];
     }
-    else
+    menu->battle.enemy.hp = (int)get_svarint(&reader);
+    menu->battle.turns = (int)get_varint(&reader);
+    menu->battle.result = (int)get_varint(&reader);
+
+    uint64_t unread = get_varint(&reader);
+    if (unread > sizeof(input->buffer) || unread > reader.size - reader.pos)
+    {
+        reader.error = 1;
+    }
+    if (reader.error)
     {
-        printf("只有在城镇或安全地点才能安全地休息！\n");
+        slab_free(SLAB_SESSION_STATE, state);
+        return 0;
     }
+    memcpy(input->buffer, reader.data + reader.pos, (size_t)unread);
+    input->length = (int)unread;
+
+    free(session->image);
+    session->image = NULL;
+    session->image_size = 0;
+    session->state = state;
+    return 1;
 }
 
-void level_up(GameData *game)
+// 让分片中空闲超过时限的会话休眠
+void hibernate_idle_sessions(Worker *worker, time_t now)
 {
-    while (game->player.exp >= game->player.level * 100)
+    time_t cutoff = now - worker->server->hibernate_after;
+
+    mutex_lock(&worker->lock);
+    Session *session = worker->active_head;
+    while (session && session->active <= cutoff)
     {
-        game->player.level++;
-        game->player.max_hp += 20;
-        game->player.hp = game->player.max_hp;
-        game->player.max_mp += 10;
-        game->player.mp = game->player.max_mp;
-        game->player.attack += 5;
-        game->player.defense += 2;
-        game->player.agility += 3;
-        game->player.intelligence += 2;
+        Session *next = session->next;
+        int busy = 0;
 
-        printf("恭喜升级到 %d 级！\n", game->player.level);
-        printf("生命值 +%d，魔法值 +%d  ", 20, 10);
-        printf("攻击力 +%d，防御力 +%d  ", 5, 2);
-        printf("敏捷 +%d，智力 +%d\n", 3, 2);
+        // 正在被处理的会话处理完后会移到链表末尾
+        if (atomic_compare_exchange_strong(&session->busy, &busy, 1))
+        {
+            if (hibernate_session(session))
+            {
+                unlink_session(session);
+            }
+            release_session(session);
+        }
+        session = next;
     }
+    mutex_unlock(&worker->lock);
 }
 
-int calculate_damage(int attacker_attack, int defender_defense)
+// ---------- 工作线程 ----------
+
+// 从其他分片的队列顶部窃取一个会话，从随机位置开始轮流尝试
+Session *steal_session(Worker *worker)
 {
-    int base_damage = attacker_attack - (defender_defense / 2);
-    if (base_damage < 1)
-        base_damage = 1;
+    Server *server = worker->server;
 
-    int variance = base_damage / 4;
-    if (variance < 1)
-        variance = 1;
+    worker->steal_seed ^= worker->steal_seed << 13;
+    worker->steal_seed ^= worker->steal_seed >> 7;
+    worker->steal_seed ^= worker->steal_seed << 17;
 
-    int final_damage = base_damage + (rand() % (variance * 2)) - variance;
-    if (final_damage < 1)
-        final_damage = 1;
+    int start = (int)(worker->steal_seed % (uint64_t)server->worker_count);
+    for (int i = 0; i < server->worker_count; i++)
+    {
+        Worker *victim = &server->workers[(start + i) % server->worker_count];
+        if (victim == worker)
+            continue;
 
-    return final_damage;
+        Session *session = work_steal(&victim->queue);
+        if (session)
+            return session;
+    }
+    return NULL;
 }
 
-void load_game(GameData *game)
+// 自己处理不完时叫醒一个空闲的工作线程来窃取
+void wake_idle_worker(Worker *worker)
 {
-    FILE *file = fopen("savegame.dat", "rb");
-    if (file == NULL)
+    Server *server = worker->server;
+
+    for (int i = 1; i < server->worker_count; i++)
     {
-        printf("无法加载游戏。\n");
-        return;
+        Worker *other = &server->workers[(worker->index + i) % server->worker_count];
+        int idle = 1;
+        if (atomic_compare_exchange_strong(&other->idle, &idle, 0))
+        {
+            uint64_t one = 1;
+            if (write(other->wake_fd, &one, sizeof(one)) < 0)
+            {
+                // 计数器溢出时对方本来就会醒来
+            }
+            return;
+        }
     }
-
-    fread(game, sizeof(GameData), 1, file);
-    fclose(file);
-    printf("游戏已加载。\n");
 }
 
-void talk_to_npc(GameData *game)
+THREAD_FUNC(server_worker)
 {
-    int npc_count = 0;
-    int npc_indices[15];
+    Worker *worker = arg;
+    Server *server = worker->server;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    // 每个分片固定在一个核心上
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->index % CPU_SETSIZE, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
 
-    switch (game->current_location)
+    for (;;)
     {
-    case 0:                  // 瓦纳卡村
-        npc_indices[0] = 0;  // 武器商人
-        npc_indices[1] = 1;  // 村长
-        npc_indices[2] = 2;  // 防具商人
-        npc_indices[3] = 3;  // 药剂师
-        npc_indices[4] = 16; // 村民
-        npc_indices[5] = 17; // 老者
-        npc_indices[6] = 19; // 神秘女子
-        npc_count = 7;
-        printf("==========可以交谈的NPC==========\n");
-        for (int i = 0; i < npc_count; i++)
+        Session *session = work_pop(&worker->queue);
+        if (session == NULL)
         {
-            printf("%d. %s\n", i + 1, game->npcs[npc_indices[i]].name);
+            session = steal_session(worker);
         }
-        printf("请选择要交谈的NPC：\n");
-        break;
-    case 4:                  // 王城
-        npc_indices[0] = 2;  // 防具商人
-        npc_indices[1] = 3;  // 药剂师
-        npc_indices[2] = 4;  // 技能导师
-        npc_indices[3] = 5;  // 国王
-        npc_indices[4] = 8;  // 铁匠
-        npc_indices[5] = 11; // 图书管理员
-        npc_count = 6;
-        printf("==========可以交谈的NPC==========\n");
-        for (int i = 0; i < npc_count; i++)
-        {
-            printf("%d. %s\n", i + 1, game->npcs[npc_indices[i]].name);
-        }
-        printf("请选择要交谈的NPC：\n");
-        break;
-    case 9:                  // 海盗港湾
-        npc_indices[0] = 0;  // 武器商人
-        npc_indices[1] = 6;  // 船长
-        npc_indices[2] = 10; // 老渔夫
-        npc_count = 3;
-        break;
-        printf("==========可以交谈的NPC==========\n");
-        for (int i = 0; i < npc_count; i++)
+        if (session)
         {
-            printf("%d. %s\n", i + 1, game->npcs[npc_indices[i]].name);
+            run_session(session);
+            continue;
         }
-        printf("请选择要交谈的NPC：\n");
-    case 8:                 // 精灵之森
-        npc_indices[0] = 4; // 技能导师
-        npc_indices[1] = 7; // 精灵长老
-        npc_count = 2;
-        break;
-        printf("==========可以交谈的NPC==========\n");
-        for (int i = 0; i < npc_count; i++)
+
+        // 先标记空闲再试一次窃取，避免错过刚压入的会话
+        atomic_store(&worker->idle, 1);
+        session = steal_session(worker);
+        if (session)
         {
-            printf("%d. %s\n", i + 1, game->npcs[npc_indices[i]].name);
+            atomic_store(&worker->idle, 0);
+            run_session(session);
+            continue;
         }
-        printf("请选择要交谈的NPC：\n");
-    case 13:                 // 魔法学院
-        npc_indices[0] = 4;  // 技能导师
-        npc_indices[1] = 11; // 图书管理员
-        npc_indices[2] = 13; // 炼金术士
-        npc_indices[3] = 14; // 占卜师
-        npc_count = 4;
-        printf("==========可以交谈的NPC==========\n");
-        for (int i = 0; i < npc_count; i++)
+
+        // 没事做的时候顺便让空闲的会话休眠
+        time_t now = time(NULL);
+        if (server->hibernate_after > 0 && now >= worker->next_scan)
         {
-            printf("%d. %s\n", i + 1, game->npcs[npc_indices[i]].name);
+            hibernate_idle_sessions(worker, now);
+            worker->next_scan = now + 1;
         }
-        printf("请选择要交谈的NPC：\n");
-        break;
-    case 10:                 // 火山口
-        npc_indices[0] = 12; // 赏金猎人
-        npc_count = 1;
-        break;
-    case 12:                 // 黑暗沼泽
-        npc_indices[0] = 12; // 赏金猎人
-        npc_count = 1;
-        printf("==========可以交谈的NPC==========\n");
-        for (int i = 0; i < npc_count; i++)
+        if (worker->index == 0 && slab_report_requested)
         {
-            printf("%d. %s\n", i + 1, game->npcs[npc_indices[i]].name);
+            slab_report_requested = 0;
+            slab_report(stdout);
         }
-        printf("请选择要交谈的NPC：\n");
-        break;
-    default:
-        printf("这里没有可以交谈的NPC。\n");
-        return;
-    }
-
-    int choice;
-    scanf("%d", &choice);
-
-    if (choice == 0)
-        return;
-
-    choice--;
-
-    if (choice >= 0 && choice < npc_count)
-    {
-        int npc_index = npc_indices[choice];
-
-        // 根据恶龙是否被击败显示不同的对话
-        if (game->dragon_defeated &&
-            (npc_index == 1 || npc_index == 5 || npc_index == 16 || npc_index == 19))
+        if (worker->index == 0 && content_reload_requested)
         {
-            // 恶龙被击败后
-            switch (npc_index)
-            {
-            case 1: // 村长
-                printf("\n%s: \"伟大的勇者！你拯救了我们所有人！\"", game->npcs[npc_index].name);
-                printf("\n%s: \"整个村庄都在庆祝你的胜利！\"", game->npcs[npc_index].name);
-                break;
-            case 5: // 国王
-                printf("\n%s: \"伟大的英雄！您拯救了整个王国！人民将永远铭记你的功绩。\"", game->npcs[npc_index].name);
-                printf("\n%s: \"王国的和平与繁荣都归功于你！\"", game->npcs[npc_index].name);
-                printf("\n%s: \"你的事迹将被各地传颂。\"", game->npcs[npc_index].name);
-                break;
-            case12: // 赏金猎人
-                printf("\n%s:恭喜！你我都圆满完成各自的使命！", game->npcs[npc_index].name);
-            case 14: // 占卜师
-                printf("\n%s: \"你果然做到了，打破了既定的命运！\"", game->npcs[npc_index].name);
-                printf("\n%s: \"但你仍需小心前方的道路。\"", game->npcs[npc_index].name);
-            case 16: // 村民
-                printf("\n%s: \"英雄！感谢你拯救了我们的村庄！\"", game->npcs[npc_index].name);
-                printf("\n%s: \"你将是我们传说中永远的英雄！\"", game->npcs[npc_index].name);
-                break;
-            case 17: // 老者
-                printf("\n%s: \"力量会随岁月流逝，但勇气不会。！\"", game->npcs[npc_index].name);
-            case 19: // 神秘女子
-                printf("\n%s: \"命运的轨迹已经改变，光明重新回到了这个世界。\"", game->npcs[npc_index].name);
-                printf("\n%s: \"你的勇气将被永远铭记\"", game->npcs[npc_index].name);
-                break;
-            }
+            content_reload_requested = 0;
+            reload_content();
         }
-        else
-        {
-            printf("\n%s: \"%s\"\n", game->npcs[npc_index].name, game->npcs[npc_index].dialog);
 
-            for (int i = 0; i < game->npcs[npc_index].additional_dialogs_count; i++)
-            {
-                printf("%s: \"%s\"\n", game->npcs[npc_index].name, game->npcs[npc_index].additional_dialogs[i]);
-            }
-        }
+        int count = epoll_wait(worker->epoll_fd, events, SERVER_MAX_EVENTS, 1000);
+        atomic_store(&worker->idle, 0);
+        if (count < 0 && errno != EINTR)
+            break;
 
-        if (npc_index == 18)
+        for (int i = 0; i < count; i++)
         {
-            printf("\n%s: \"在我的旅店里休息一晚，就可以完全恢复你的全部状态。\"");
-            printf("\n是否要休息一晚？(y/n): ");
-            char rest_choice;
-            scanf(" %c", &rest_choice);
-            if (rest_choice == 'y' || rest_choice == 'Y')
+            void *target = events[i].data.ptr;
+            if (target == NULL)
+            {
+                accept_sessions(server);
+            }
+            else if (target == worker)
             {
-                if (game->player.gold >= game->npcs[npc_index].item_price)
+                uint64_t value;
+                if (read(worker->wake_fd, &value, sizeof(value)) < 0)
                 {
-                    game->player.gold -= game->npcs[npc_index].item_price;
-                    int restore_hp = game->player.max_hp - game->player.hp;
-                    int restore_mp = game->player.max_mp - game->player.mp;
-                    game->player.hp = game->player.max_hp;
-                    game->player.mp = game->player.max_mp;
-                    printf("你在旅店里好好休息了一番...\n");
-                    printf("恢复了%d点生命值和%d点魔法值！\n", restore_hp, restore_mp);
+                    // 已经被别的事件清空
                 }
-            }
-        }
-
-        if (npc_index == 0 || npc_index == 2 || npc_index == 3 || npc_index == 8 || npc_index == 9 || npc_index == 13)
-        {
-            printf("\n%s愿意与你交易。\n", game->npcs[npc_index].name);
-            printf("是否要看看他的商品？(y/n): ");
-            char shop_choice;
-            scanf(" %c", &shop_choice);
-            if (shop_choice == 'y' || shop_choice == 'Y')
+            }
+            else if (!work_push(&worker->queue, target))
             {
-                shop_menu(game, npc_index);
+                run_session(target);
             }
         }
-        else if (npc_index == 4)
+
+        if (count > 1)
         {
-            printf("\n%s可以教你新技能。\n", game->npcs[npc_index].name);
-            printf("是否要学习新技能？(y/n): ");
-            char learn_choice;
-            scanf(" %c", &learn_choice);
-            if (learn_choice == 'y' || learn_choice == 'Y')
-            {
-                learn_skills(game);
-            }
+            wake_idle_worker(worker);
         }
     }
-    else
-    {
-        printf("无效的选择。\n");
-    }
+
+    THREAD_RETURN;
 }
 
-void shop_menu(GameData *game, int npc_index)
+int run_server(int argc, char *argv[])
 {
-    Npc *npc = &game->npcs[npc_index];
+    Server server;
+    const char *address = NULL;
+    int threads = cpu_count();
+    int hibernate_after = 60;
 
-    printf("\n========== %s的商店 ==========\n", npc->name);
-    for (int i = 0; i < npc->shop_item_count; i++)
+    for (int i = 0; i < argc; i++)
     {
-        int item_index = npc->shop_items[i];
-        Item *item = &game->items[item_index];
-        printf("%d. %s - %d金币 ", i + 1, item->name, item->price);
-        switch (item->type)
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
         {
-        case 0:
-            printf("(武器: +%d攻击)", item->value);
-            break;
-        case 1:
-            printf("(防具: +%d防御)", item->value);
-            break;
-        case 2:
-            printf("(消耗品: 恢复%d HP)", item->value);
-            break;
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            hibernate_after = atoi(argv[++i]);
+        }
+        else
+        {
+            address = argv[i];
         }
-        printf("\n");
     }
-    printf("你有%d金币。\n", game->player.gold);
-    printf("请选择要购买的物品 (0返回): ");
 
-    int choice;
-    scanf("%d", &choice);
-
-    if (choice == 0)
-        return;
-
-    choice--;
+    if (address == NULL || threads < 1 || hibernate_after < 0)
+    {
+        printf("用法: --server 端口|unix:路径 [-t 线程数] [-i 休眠秒数]\n");
+        return 1;
+    }
 
-    if (choice >= 0 && choice < npc->shop_item_count)
+    memset(&server, 0, sizeof(server));
+    server.seed = (uint64_t)time(NULL);
+    server.hibernate_after = hibernate_after;
+    server.listen_fd = open_listener(address);
+    if (server.listen_fd < 0)
     {
-        int item_index = npc->shop_items[choice];
-        Item *item = &game->items[item_index];
+        printf("无法监听：%s\n", address);
+        return 1;
+    }
 
-        if (game->player.gold >= item->price)
-        {
-            if (game->inventory_count < MAX_INVENTORY)
-            {
-                game->player.gold -= item->price;
-                game->inventory[game->inventory_count] = *item;
-                game->inventory_count++;
-                printf("你购买了%s！\n", item->name);
-            }
-            else
-            {
-                printf("背包已满！\n");
-            }
-        }
-        else
+    server.worker_count = threads;
+    server.workers = calloc(threads, sizeof(Worker));
+    for (int i = 0; i < threads; i++)
+    {
+        Worker *worker = &server.workers[i];
+        struct epoll_event event;
+
+        worker->server = &server;
+        worker->index = i;
+        mutex_init(&worker->lock);
+        worker->steal_seed = 0x9E3779B97F4A7C15ull * (uint64_t)(i + 1);
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        event.events = EPOLLIN;
+        event.data.ptr = worker;
+        if (worker->epoll_fd < 0 || worker->wake_fd < 0 ||
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event) != 0)
         {
-            printf("金币不足！\n");
+            printf("无法创建epoll。\n");
+            return 1;
         }
     }
-    else
+
+    // 只由第一个工作线程接受连接
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (epoll_ctl(server.workers[0].epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event) != 0)
+    {
+        printf("无法创建epoll。\n");
+        return 1;
+    }
+
+    // 启动时的世界是第一个内容包版本
+    content_version = calloc(1, sizeof(ContentVersion));
+    content_version->world = current_world;
+    content_version->generation = 1;
+    content_version->users = 1;
+    atomic_init(&published_world, current_world);
+    atomic_init(&published_generation, 1);
+
+    signal(SIGUSR1, request_slab_report);
+    signal(SIGHUP, request_content_reload);
+    printf("服务器已启动：%s，%d个工作线程\n", address, threads);
+    fflush(stdout);
+
+    for (int i = 1; i < threads; i++)
     {
-        printf("无效的选择。\n");
+        thread_start(&server.workers[i].thread, server_worker, &server.workers[i]);
     }
+    server_worker(&server.workers[0]);
+
+    return 0;
 }
 
-void show_inventory(GameData *game)
+#else
+
+int run_server(int argc, char *argv[])
 {
-    printf("\n========== 背包 ==========\n");
-    if (game->inventory_count == 0)
+    (void)argc;
+    (void)argv;
+    printf("服务器模式只支持Linux。\n");
+    return 1;
+}
+
+#endif
+
+// ========== 线程 ==========
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+int thread_start(Thread *thread, ThreadFunc func, void *arg)
+{
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, func, arg) == 0;
+#endif
+}
+
+void thread_join(Thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void mutex_init(Mutex *mutex)
+{
+#ifdef _WIN32
+    InitializeSRWLock(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_lock(Mutex *mutex)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(Mutex *mutex)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void cond_init(CondVar *cond)
+{
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_wait(CondVar *cond, Mutex *mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void cond_signal(CondVar *cond)
+{
+#ifdef _WIN32
+    WakeConditionVariable(cond);
+#else
+    pthread_cond_signal(cond);
+#endif
+}
+
+void cond_broadcast(CondVar *cond)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+// ========== 平衡性模拟 ==========
+// 用法: Dragon_Quest --simulate [-l 等级范围] [-p 地点列表] [-s 策略] [-n 次数] [-t 线程数] [-r 种子]
+// 例如: Dragon_Quest --simulate -l 1-30 -p 1,2,6 -s skill -n 1000000
+
+// 按当前策略选择行动
+void choose_sim_action(GameData *game, BattleState *state, int strategy, BattleAction *action)
+{
+    Player *player = &game->player;
+
+    action->type = ACTION_ATTACK;
+    action->skill_index = -1;
+
+    if (strategy == STRATEGY_ATTACK)
+        return;
+
+    // 谨慎策略：生命值低于30%时尝试逃跑
+    if (strategy == STRATEGY_CAUTIOUS && state->enemy_type != 3 && player->hp * 10 < player->max_hp * 3)
     {
-        printf("背包是空的。\n");
+        action->type = ACTION_FLEE;
+        return;
     }
-    else
+
+    // 使用MP足够的伤害最高的技能
+    int best_damage = -1;
+    int skills[MAX_SKILLS];
+    int skill_count = skill_set_list(&game->learned_skills, skills);
+    for (int i = 0; i < skill_count; i++)
     {
-        for (int i = 0; i < game->inventory_count; i++)
+        int skill_index = skills[i];
+        const Skill *skill = &game->world->skills[skill_index];
+
+        if (player->level >= skill->required_level && player->mp >= skill->mp_cost && skill->damage > best_damage)
         {
-            printf("%d. %s", i + 1, game->inventory[i].name);
-            switch (game->inventory[i].type)
-            {
-            case 0:
-                printf(" (武器: +%d攻击)", game->inventory[i].value);
-                break;
-            case 1:
-                printf(" (防具: +%d防御)", game->inventory[i].value);
-                break;
-            case 2:
-                printf(" (消耗品: 恢复%d HP)", game->inventory[i].value);
-                break;
-            }
-            printf("\n");
+            best_damage = skill->damage;
+            action->type = ACTION_SKILL;
+            action->skill_index = skill_index;
         }
     }
-    printf("========================\n");
 }
 
-void use_item(GameData *game)
+// 生成指定等级的角色，并学会该等级可学的全部技能
+void setup_sim_player(GameData *game, int level)
 {
-    if (game->inventory_count == 0)
+    init_player_stats(&game->player);
+    strcpy(game->player.name, "模拟勇者");
+
+    while (game->player.level < level)
     {
-        printf("背包是空的。\n");
-        return;
+        game->player.exp = game->player.level * 100;
+        gain_level(&game->player);
     }
+    game->player.exp = 0;
 
-    show_inventory(game);
-    printf("请选择要使用的物品 (输入编号，0取消): ");
+    game->learned_skills = skills_for_level(game->world, level);
+}
+
+// 模拟一场战斗并记录结果
+void simulate_battle(GameData *game, const Player *start, int strategy, SimStats *stats)
+{
+    BattleState state;
+    BattleAction action;
+    BattleEvent events[MAX_BATTLE_EVENTS];
 
-    int choice;
-    scanf("%d", &choice);
+    game->player = *start;
+    game->dragon_defeated = 0;
 
-    if (choice == 0)
+    int enemy_type = choose_enemy(game);
+    if (enemy_type < 0)
         return;
 
-    choice--;
-
-    if (choice >= 0 && choice < game->inventory_count)
+    long damage_taken = 0;
+    battle_begin(game, &state, enemy_type);
+    while (state.result == BATTLE_ONGOING && state.turns < SIM_MAX_TURNS)
     {
-        Item *item = &game->inventory[choice];
-
-        switch (item->type)
+        choose_sim_action(game, &state, strategy, &action);
+        int event_count = battle_step(game, &state, &action, events);
+        for (int i = 0; i < event_count; i++)
         {
-        case 0: // 武器
-            printf("你装备了%s，增加了%d点攻击力！\n", item->name, item->value);
-            // 移除物品
-            for (int i = choice; i < game->inventory_count - 1; i++)
-            {
-                game->inventory[i] = game->inventory[i + 1];
-            }
-            game->inventory_count--;
-            break;
-        case 1: // 防具
-            printf("你装备了%s，增加了%d点防御力！\n", item->name, item->value);
-
-            for (int i = choice; i < game->inventory_count - 1; i++)
-            {
-                game->inventory[i] = game->inventory[i + 1];
-            }
-            game->inventory_count--;
-            break;
-        case 2: // 消耗品
-            if (strcmp(item->name, "力量药剂") == 0)
-            {
-                game->player.attack += 5;
-                printf("你使用了%s，永久增加了5点攻击力！\n", item->name);
-            }
-            else if (strcmp(item->name, "敏捷药剂") == 0)
-            {
-                game->player.agility += 5;
-                printf("你使用了%s，永久增加了5点敏捷！\n", item->name);
-            }
-            else if (strcmp(item->name, "智力药剂") == 0)
-            {
-                game->player.intelligence += 5;
-                game->player.max_mp += 20;
-                game->player.mp += 20;
-                if (game->player.mp > game->player.max_mp)
-                {
-                    game->player.mp = game->player.max_mp;
-                }
-                printf("你使用了%s，永久增加了5点智力和20点最大魔法值！\n", item->name);
-            }
-            else
-            {
-                game->player.hp += item->value;
-                if (game->player.hp > game->player.max_hp)
-                {
-                    game->player.hp = game->player.max_hp;
-                }
-                printf("你使用了%s，恢复了%d点生命值！\n", item->name, item->value);
-            }
-
-            // 移除已使用的消耗品
-            for (int i = choice; i < game->inventory_count - 1; i++)
-            {
-                game->inventory[i] = game->inventory[i + 1];
-            }
-            game->inventory_count--;
-            break;
+            if (events[i].type == EVENT_ENEMY_ATTACK)
+                damage_taken += events[i].value;
         }
     }
-    else
+
+    stats->total_turns += state.turns;
+    switch (state.result)
     {
-        printf("无效的选择。\n");
+    case BATTLE_WON:
+        stats->wins++;
+        break;
+    case BATTLE_FLED:
+        stats->fled++;
+        break;
+    case BATTLE_LOST:
+        stats->losses++;
+        stats->hp_loss[SIM_HP_BUCKETS]++;
+        return;
+    default:
+        stats->timeouts++;
+        break;
     }
+
+    // 胜利后升级会回满生命，因此按战斗中承受的伤害计算损失比例
+    int bucket = (int)(damage_taken * SIM_HP_BUCKETS / start->max_hp);
+    if (bucket >= SIM_HP_BUCKETS)
+        bucket = SIM_HP_BUCKETS - 1;
+    stats->hp_loss[bucket]++;
 }
 
-void save_game(GameData *game)
+THREAD_FUNC(simulation_worker)
 {
-    FILE *file = fopen("savegame.dat", "wb");
-    if (file == NULL)
+    SimWorker *worker = (SimWorker *)arg;
+    SimJob *job = worker->job;
+    GameData *game = malloc(sizeof(GameData));
+    Player start;
+
+    *game = *job->base;
+    rng_seed(&game->rng, worker->seed);
+    for (int i = 0; i < job->cell_count; i++)
     {
-        printf("无法保存游戏！\n");
-        return;
+        SimCell *cell = &job->cells[i];
+
+        setup_sim_player(game, cell->level);
+        game->current_location = cell->location;
+        start = game->player;
+
+        for (long n = 0; n < worker->trials; n++)
+        {
+            simulate_battle(game, &start, job->strategy, &worker->stats[i]);
+        }
     }
 
-    fwrite(game, sizeof(GameData), 1, file);
-    fclose(file);
-    printf("游戏已保存。\n");
+    free(game);
+    THREAD_RETURN;
 }
 
-int file_exists(const char *filename)
+// 终端显示宽度，中文字符占两格
+int display_width(const char *text)
 {
-    FILE *file = fopen(filename, "r");
-    if (file)
+    int width = 0;
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++)
     {
-        fclose(file);
-        return 1;
+        if (*p < 0x80)
+            width++;
+        else if (*p >= 0xC0)
+            width += 2;
     }
-    return 0;
+    return width;
 }
 
-// 学习新技能
-void learn_skills(GameData *game)
+void print_sim_stats(GameData *game, SimCell *cell, SimStats *stats)
 {
-    printf("\n========== 可学习的技能 ==========\n");
-    int available_skills = 0;
-    int available_skill_indices[MAX_SKILLS];
+    long total = stats->wins + stats->fled + stats->losses + stats->timeouts;
+    if (total == 0)
+        return;
+
+    const char *name = text(game->world, game->world->locations[cell->location].name);
+    printf("%4d  %s%*s %6.1f%% %6.1f%% %6.1f%% %8.2f  ",
+           cell->level, name, 12 - display_width(name), "",
+           100.0 * stats->wins / total, 100.0 * stats->fled / total,
+           100.0 * stats->losses / total, (double)stats->total_turns / total);
+    for (int i = 0; i <= SIM_HP_BUCKETS; i++)
+    {
+        printf(" %5.1f", 100.0 * stats->hp_loss[i] / total);
+    }
+    printf("\n");
+}
 
-    for (int i = 0; i < MAX_SKILLS && i < 19; i++) // 限制在实际定义的范围内
+int run_simulation(int argc, char *argv[])
+{
+    int min_level = 1, max_level = 30;
+    int locations[MAX_LOCATIONS];
+    int location_count = 0;
+    int strategy = STRATEGY_SKILL;
+    long trials = 100000;
+    int threads = cpu_count();
+    uint64_t seed = (uint64_t)time(NULL);
+
+    for (int i = 0; i + 1 < argc; i += 2)
     {
-        int learned = 0;
-        // 检查技能是否已学会
-        for (int j = 0; j < game->learned_skill_count; j++)
+        if (strcmp(argv[i], "-l") == 0)
+        {
+            if (sscanf(argv[i + 1], "%d-%d", &min_level, &max_level) == 1)
+                max_level = min_level;
+        }
+        else if (strcmp(argv[i], "-p") == 0)
         {
-            if (game->learned_skills[j] == i)
+            char *p = argv[i + 1];
+            while (*p && location_count < MAX_LOCATIONS)
             {
-                learned = 1;
-                break;
+                locations[location_count++] = (int)strtol(p, &p, 10);
+                if (*p == ',')
+                    p++;
+                else
+                    break;
             }
         }
-
-        // 检查玩家等级是否满足要求
-        if (!learned && game->player.level >= game->skills[i].required_level)
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            if (strcmp(argv[i + 1], "attack") == 0)
+                strategy = STRATEGY_ATTACK;
+            else if (strcmp(argv[i + 1], "cautious") == 0)
+                strategy = STRATEGY_CAUTIOUS;
+            else
+                strategy = STRATEGY_SKILL;
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            trials = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-t") == 0)
         {
-            printf("%d. %s (需要等级: %d)",
-                   available_skills + 1,
-                   game->skills[i].name,
-                   game->skills[i].required_level);
+            threads = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        }
+    }
 
-            if (game->skills[i].damage > 0)
-            {
-                printf(" - 造成%d点伤害", game->skills[i].damage);
-            }
-            if (game->skills[i].heal > 0)
-            {
-                printf(" - 恢复%d点生命", game->skills[i].heal);
-            }
-            printf("\n");
+    if (min_level < 1)
+        min_level = 1;
+    if (max_level < min_level)
+        max_level = min_level;
+    if (threads < 1)
+        threads = 1;
+    if (trials < threads)
+        trials = threads;
 
-            available_skill_indices[available_skills] = i;
-            available_skills++;
+    GameData *base = calloc(1, sizeof(GameData));
+    base->world = current_world;
+
+    // 默认模拟所有有敌人出没的地点
+    if (location_count == 0)
+    {
+        for (int i = 0; i < MAX_LOCATIONS; i++)
+        {
+            base->current_location = i;
+            if (choose_enemy(base) >= 0)
+                locations[location_count++] = i;
         }
     }
 
-    if (available_skills == 0)
+    SimJob job;
+    job.base = base;
+    job.strategy = strategy;
+    job.cell_count = 0;
+    job.cells = malloc(sizeof(SimCell) * (max_level - min_level + 1) * location_count);
+    for (int level = min_level; level <= max_level; level++)
     {
-        printf("当前没有可学习的新技能。\n");
-        return;
+        for (int i = 0; i < location_count; i++)
+        {
+            if (locations[i] < 0 || locations[i] >= MAX_LOCATIONS)
+                continue;
+            job.cells[job.cell_count].level = level;
+            job.cells[job.cell_count].location = locations[i];
+            job.cell_count++;
+        }
     }
 
-    printf("请选择要学习的技能 (0返回): ");
-    int choice;
-    scanf("%d", &choice);
+    // 每个线程使用独立的随机数序列，相同的种子和线程数得到相同的结果
+    Rng master;
+    uint64_t *seeds = malloc(sizeof(uint64_t) * threads);
+    rng_seed(&master, seed);
+    rng_fill(&master, seeds, threads);
 
-    if (choice == 0)
-        return;
-
-    if (choice > 0 && choice <= available_skills)
+    SimWorker *workers = calloc(threads, sizeof(SimWorker));
+    for (int t = 0; t < threads; t++)
     {
-        int skill_index = available_skill_indices[choice - 1];
-
-        if (game->learned_skill_count < MAX_SKILLS)
-        {
-            game->learned_skills[game->learned_skill_count] = skill_index;
-            game->learned_skill_count++;
-            printf("你学会了新技能：%s！\n", game->skills[skill_index].name);
-        }
-        else
+        workers[t].job = &job;
+        workers[t].seed = seeds[t];
+        workers[t].trials = trials / threads + (t < trials % threads ? 1 : 0);
+        workers[t].stats = calloc(job.cell_count, sizeof(SimStats));
+        if (!thread_start(&workers[t].thread, simulation_worker, &workers[t]))
         {
-            printf("技能栏已满！\n");
+            printf("无法创建模拟线程！\n");
+            return 1;
         }
     }
-    else
+
+    for (int t = 0; t < threads; t++)
     {
-        printf("无效的选择。\n");
+        thread_join(workers[t].thread);
     }
-}
 
-void cheat_game(GameData *game)
-{
-    printf("========== 作弊列表 ==========\n");
-    printf("1. 添加2000点经验\n");
-    printf("2. 添加2000点金币\n");
-    printf("3. 添加100点生命值\n");
-    printf("4. 添加100点魔法值\n");
-    printf("5. 添加100点攻击力\n");
-    printf("6. 添加100点防御力\n");
-    printf("7. 添加100点敏捷\n");
-    printf("8. 添加100点智力\n");
-    printf("请选择要使用的作弊 (0返回): ");
-    int cheat_choice;
-    scanf("%d", &cheat_choice);
-
-    switch (cheat_choice)
+    printf("每组模拟%ld场战斗，%d个线程，随机数种子%" PRIu64 "\n", trials, threads, seed);
+    printf("等级  地点            胜率    逃跑    失败  平均回合  HP损失分布(每列10%%，最后一列为阵亡)\n");
+    for (int i = 0; i < job.cell_count; i++)
     {
-    case 1:
-        game->player.exp += 2000;
-        printf("已添加2000点经验！\n");
-        if (game->player.exp >= game->player.level * 100)
+        SimStats total = {0};
+        for (int t = 0; t < threads; t++)
         {
-            level_up(game);
+            SimStats *stats = &workers[t].stats[i];
+            total.wins += stats->wins;
+            total.fled += stats->fled;
+            total.losses += stats->losses;
+            total.timeouts += stats->timeouts;
+            total.total_turns += stats->total_turns;
+            for (int b = 0; b <= SIM_HP_BUCKETS; b++)
+            {
+                total.hp_loss[b] += stats->hp_loss[b];
+            }
         }
-        break;
-    case 2:
-        game->player.gold += 2000;
-        printf("已添加2000点金币！\n");
-        break;
-    case 3:
-        game->player.max_hp += 100;
-        printf("已添加100点生命值！\n");
-        break;
-    case 4:
-        game->player.max_mp += 100;
-        printf("已添加100点魔法值！\n");
-        break;
-    case 5:
-        game->player.attack += 100;
-        printf("已添加100点攻击力！\n");
-        break;
-    case 6:
-        game->player.defense += 100;
-        printf("已添加100点防御力！\n");
-        break;
-    case 7:
-        game->player.agility += 100;
-        printf("已添加100点敏捷！\n");
-        break;
-    case 8:
-        game->player.intelligence += 100;
-        printf("已添加100点智力！\n");
-        break;
-    case 0:
-        main_menu(game);
-        break;
-    default:
-        printf("无效的选择。\n");
-        main_menu(game);
+        print_sim_stats(base, &job.cells[i], &total);
     }
 
-    return;
+    for (int t = 0; t < threads; t++)
+    {
+        free(workers[t].stats);
+    }
+    free(workers);
+    free(seeds);
+    free(job.cells);
+    free(base);
+    return 0;
 }